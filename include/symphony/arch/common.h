@@ -11,11 +11,62 @@
 
 #include <symphony/types.h>
 
+/**
+ * @brief Maximum number of CPUs supported by the kernel.
+ */
+#define MAX_CPUS 1
+
 /**
  * @brief Halt the CPU.
  */
 void arch_halt(void);
 
+/**
+ * @brief Get the index of the CPU executing this function.
+ *
+ * @return CPU index, always less than MAX_CPUS
+ */
+int arch_cpu_current(void);
+
+/**
+ * @brief Read the CPU timestamp counter.
+ *
+ * The counter only ever goes up, but its frequency is architecture and
+ * machine dependent, so values are only meaningful relative to each other.
+ *
+ * @return Current counter value
+ */
+uint64_t arch_timestamp(void);
+
+/**
+ * @brief Get the frequency of the arch_timestamp() counter.
+ *
+ * @details Never calibrates the counter itself. Architectures which have to
+ * do so calibrate it in arch_init_very_early().
+ *
+ * @return Counter frequency in Hz, 0 if it is not known (yet)
+ */
+uint64_t arch_timestamp_frequency(void);
+
+/**
+ * @brief Zero out whole pages.
+ *
+ * @details Uses cache-bypassing stores where the architecture has them, so
+ * clearing memory does not evict data that is actually in use.
+ *
+ * @param addr Page-aligned address of the first page
+ * @param pages Number of pages to zero out
+ */
+void arch_clear_pages(void* addr, size_t pages);
+
+/**
+ * @brief Copy a whole page.
+ *
+ * @param dest Page-aligned destination address
+ * @param src Page-aligned source address
+ */
+void arch_copy_page(void* dest, const void* src);
+
 /**
  * @brief Initialize current processor (very early stage)
  *
@@ -87,12 +138,27 @@ inline int arch_init_full(int cpu) {
 void arch_set_kernel_stack(int cpu, void* stack);
 
 /**
- * @brief Allocate new, empty top-level page table.
+ * @brief Allocate new top-level page table.
+ *
+ * @details The lower (user) half of the page table is empty, while the upper
+ * (kernel) half is shared with the kernel page table.
  *
  * @return Pointer to the newly allocated top-level page table
  */
 void* arch_vmm_new_pt(void);
 
+/**
+ * @brief Allocate the kernel top-level page table.
+ *
+ * @details The upper half of this page table is shared by all page tables
+ * allocated with arch_vmm_new_pt() afterwards, so that kernel mappings are
+ * the same in all address spaces. Must be called once, before any call to
+ * arch_vmm_new_pt().
+ *
+ * @return Pointer to the kernel top-level page table
+ */
+void* arch_vmm_new_kernel_pt(void);
+
 /**
  * @brief Free top-level page table and all sub-page tables.
  *
@@ -133,3 +199,36 @@ void arch_vmm_unmap(void* pageTable, uint64_t virtAddr);
  * @param flags VMM flags
  */
 void arch_vmm_set_flags(void* pageTable, uint64_t virtAddr, int flags);
+
+/**
+ * @brief Map a physical address range to a virtual address range.
+ *
+ * @details The page tables are descended only once for the whole range, and
+ * large pages are used wherever the alignment of the addresses allows it.
+ *
+ * @param pageTable Top-level page table, the context of this operation
+ * @param physAddr Physical address, page-aligned
+ * @param virtAddr Virtual address, page-aligned
+ * @param size Range size in bytes
+ * @param flags VMM flags
+ */
+void arch_vmm_map_range(void* pageTable, uint64_t physAddr, uint64_t virtAddr, size_t size, int flags);
+
+/**
+ * @brief Unmap a virtual address range.
+ *
+ * @param pageTable Top-level page table, the context of this operation
+ * @param virtAddr Virtual address, page-aligned
+ * @param size Range size in bytes
+ */
+void arch_vmm_unmap_range(void* pageTable, uint64_t virtAddr, size_t size);
+
+/**
+ * @brief Set the flags of all mapped pages in a virtual address range.
+ *
+ * @param pageTable Top-level page table, the context of this operation
+ * @param virtAddr Virtual address, page-aligned
+ * @param size Range size in bytes
+ * @param flags VMM flags
+ */
+void arch_vmm_protect_range(void* pageTable, uint64_t virtAddr, size_t size, int flags);
@@ -23,7 +23,8 @@ struct page_table_entry {
 	bool accessed : 1;
 	bool avl0 : 1;
 	bool pageSize : 1;
-	uint8_t avl1 : 4;
+	bool global : 1;
+	uint8_t avl1 : 3;
 	uint64_t addr : 51;
 	bool nx : 1;
 	/**@}*/
@@ -129,3 +130,81 @@ void arch_idt_set_entry(uint8_t entry, void* isr, uint8_t pdplGateType);
  * @return 0 on success, negative error value on error
  */
 int arch_interrupt_init(void);
+
+/**@{*/
+/** @brief CPU feature for arch_cpu_has_feature(). */
+#define CPU_FEATURE_PDPE1GB 0
+#define CPU_FEATURE_PCID 1
+#define CPU_FEATURE_PGE 2
+#define CPU_FEATURE_ERMS 3
+#define CPU_FEATURE_FSRM 4
+/**@}*/
+
+/**
+ * @brief Execute the CPUID instruction.
+ *
+ * @param leaf CPUID leaf (EAX)
+ * @param subleaf CPUID subleaf (ECX)
+ * @param eax Where to store the value of EAX
+ * @param ebx Where to store the value of EBX
+ * @param ecx Where to store the value of ECX
+ * @param edx Where to store the value of EDX
+ */
+void arch_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx);
+
+/**
+ * @brief Detect the features supported by the current CPU.
+ *
+ * @param cpu The CPU calling this function.
+ */
+void arch_cpu_detect_features(int cpu);
+
+/**
+ * @brief Check whether the CPU supports a feature.
+ *
+ * @param feature CPU_FEATURE_* value
+ *
+ * @return true if the feature is supported, false otherwise
+ */
+bool arch_cpu_has_feature(int feature);
+
+/**
+ * @brief Pick the memcpy(), memset() and memmove() variants best suited for
+ * the CPU. Must be called after arch_cpu_detect_features().
+ */
+void arch_string_init(void);
+
+/**
+ * @brief Determine the TSC frequency, from CPUID if possible or by counting
+ * against the PIT, which takes about 10ms.
+ */
+void arch_tsc_calibrate(void);
+
+/** @brief TLB statistics of a CPU. */
+struct arch_tlb_stats {
+	/** @brief Address space switches */
+	uint64_t switches;
+	/** @brief Switches which kept the TLB entries of the new address space */
+	uint64_t noFlushSwitches;
+	/** @brief Full TLB flushes (of non-global entries), including those done by switches */
+	uint64_t flushes;
+};
+
+/**
+ * @brief Enable global pages and PCIDs on the current CPU, if supported.
+ *
+ * @details Global pages stay in the TLB across address space switches. With
+ * PCIDs enabled, the TLB entries of each address space are tagged, so switching
+ * between address spaces does not have to flush the TLB.
+ *
+ * @param cpu The CPU calling this function.
+ */
+void arch_tlb_init(int cpu);
+
+/**
+ * @brief Get the TLB statistics of a CPU.
+ *
+ * @param cpu CPU number
+ * @param stats Where to store the statistics
+ */
+void arch_tlb_stats(int cpu, struct arch_tlb_stats* stats);
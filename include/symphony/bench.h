@@ -0,0 +1,22 @@
+/**
+ * @file bench.h
+ * @author Popa Vlad (Garnek0)
+ * @copyright BSD-2-Clause
+ *
+ * @brief
+ * Boot time micro-benchmarks, built with BENCH=1.
+ */
+
+#pragma once
+
+#include <symphony/types.h>
+
+/**
+ * @brief Run the memory management and memory function benchmarks and log
+ * the results.
+ *
+ * Allocator timings are in arch_timestamp() ticks per operation, memory
+ * function throughput is in bytes per 1000 ticks. Comparing a MM_DEBUG=1
+ * build against a regular one shows the cost of the debug checks.
+ */
+void bench_run(void);
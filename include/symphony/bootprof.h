@@ -0,0 +1,65 @@
+/**
+ * @file bootprof.h
+ * @author Popa Vlad (Garnek0)
+ * @copyright BSD-2-Clause
+ *
+ * @brief
+ * Boot phase profiler, built with BOOTPROF=1.
+ */
+
+#pragma once
+
+#include <symphony/types.h>
+
+/**
+ * @brief Maximum number of phases recorded during boot.
+ */
+#ifndef BOOTPROF_MAX_PHASES
+#define BOOTPROF_MAX_PHASES 64
+#endif
+
+/**
+ * @brief Maximum nesting depth of phases.
+ */
+#ifndef BOOTPROF_MAX_DEPTH
+#define BOOTPROF_MAX_DEPTH 8
+#endif
+
+#ifdef CONFIG_BOOTPROF
+
+/**
+ * @brief Start timing a boot phase. Phases started before the current one
+ * ends are recorded as its sub-steps.
+ *
+ * @param name Name of the phase. Must stay valid until bootprof_report().
+ */
+void bootprof_begin(const char* name);
+
+/**
+ * @brief Stop timing the innermost boot phase.
+ */
+void bootprof_end(void);
+
+/**
+ * @brief End all phases still running and log a table of phase durations,
+ * followed by the same data as comma separated "bootprof," lines for
+ * scripts to pick up.
+ *
+ * Durations include the time spent writing out logs, since the log is
+ * synchronous during boot.
+ */
+void bootprof_report(void);
+
+#else
+
+static inline void bootprof_begin(const char* name) {
+	(void)name;
+}
+
+static inline void bootprof_end(void) {
+}
+
+static inline void bootprof_report(void) {
+}
+
+#endif
@@ -11,8 +11,13 @@
 
 #include <symphony/types.h>
 
+#ifdef CONFIG_BINLOG
+#include <symphony/log.h>
+#endif
+
 /**@{*/
 /** @brief Loglevel for debug_log(). */
+#define LOGLEVEL_NONE 0
 #define LOGLEVEL_TRACE 1
 #define LOGLEVEL_DEBUG 2
 #define LOGLEVEL_INFO 3
@@ -21,6 +26,74 @@
 #define LOGLEVEL_FATAL 6
 /**@}*/
 
+/**
+ * @brief Lowest loglevel compiled into the kernel. debug_log() calls below it
+ * are removed entirely.
+ */
+#ifndef LOGLEVEL_MIN
+#define LOGLEVEL_MIN LOGLEVEL_TRACE
+#endif
+
+/**
+ * @brief Runtime loglevel threshold every subsystem starts out with, unless
+ * overridden by its LOGLEVEL_<SUBSYSTEM> value below.
+ */
+#ifndef LOGLEVEL_DEFAULT
+#define LOGLEVEL_DEFAULT LOGLEVEL_TRACE
+#endif
+
+/**@{*/
+/** @brief Log subsystems, each with its own runtime loglevel threshold. */
+#define LOG_SUBSYS_KERNEL 0
+#define LOG_SUBSYS_MM 1
+#define LOG_SUBSYS_ARCH 2
+#define LOG_SUBSYS_COUNT 3
+/**@}*/
+
+/**@{*/
+/** @brief Initial runtime loglevel threshold of each subsystem. */
+#ifndef LOGLEVEL_KERNEL
+#define LOGLEVEL_KERNEL LOGLEVEL_DEFAULT
+#endif
+#ifndef LOGLEVEL_MM
+#define LOGLEVEL_MM LOGLEVEL_DEFAULT
+#endif
+#ifndef LOGLEVEL_ARCH
+#define LOGLEVEL_ARCH LOGLEVEL_DEFAULT
+#endif
+/**@}*/
+
+/**
+ * @brief Subsystem debug_log() calls are accounted to. Source files outside
+ * the core kernel define it before including any header.
+ */
+#ifndef LOG_SUBSYSTEM
+#define LOG_SUBSYSTEM LOG_SUBSYS_KERNEL
+#endif
+
+/** @brief Runtime loglevel threshold of each subsystem. Use debug_log_set_level(). */
+extern uint8_t debugLogLevels[LOG_SUBSYS_COUNT];
+
+/**
+ * @brief Check whether a log would be printed, before doing any formatting.
+ *
+ * @param subsystem A LOG_SUBSYS_* value
+ * @param loglevel The log's loglevel
+ *
+ * @return true if the log should be printed
+ */
+static inline bool debug_log_enabled(int subsystem, int loglevel) {
+	return loglevel >= LOGLEVEL_MIN && loglevel >= __atomic_load_n(&debugLogLevels[subsystem], __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Set the runtime loglevel threshold of a subsystem.
+ *
+ * @param subsystem A LOG_SUBSYS_* value
+ * @param loglevel Logs below this loglevel are discarded
+ */
+void debug_log_set_level(int subsystem, int loglevel);
+
 /**
  * @brief Print an error string and panic if `cond` evaluates to false.
  *
@@ -48,6 +121,15 @@ void __debug_assert(int cond, const char* message, const char* func, const char*
  */
 void __debug_assert_warn(int cond, const char* message, const char* func, const char* file, int line);
 
+/**
+ * @brief Send a chunk of text to all appropriate output devices right away,
+ * bypassing the kernel log.
+ *
+ * @param str The text to be printed, does not have to be null terminated
+ * @param len Length of the text
+ */
+void debug_write(const char* str, size_t len);
+
 /**
  * @brief Print a character on all appropriate output devices.
  *
@@ -87,16 +169,124 @@ int debug_printf(const char* fmt, ...);
  */
 int debug_vprintf(const char* fmt, va_list args);
 
+/**
+ * @brief Format a string into a buffer.
+ *
+ * @param buf Buffer to store the string into
+ * @param size Size of the buffer. At most size - 1 characters are stored,
+ * followed by a null terminator.
+ * @param fmt The format string.
+ * @param ... Sequence of values to be used to replace the format specifiers in fmt
+ *
+ * @return The length of the whole formatted string, which is larger than or
+ * equal to size if it was truncated.
+ */
+int debug_snprintf(char* buf, size_t size, const char* fmt, ...);
+
+/**
+ * @brief Format a string into a buffer, via variadic list.
+ *
+ * @param buf Buffer to store the string into
+ * @param size Size of the buffer. At most size - 1 characters are stored,
+ * followed by a null terminator.
+ * @param fmt The format string.
+ * @param args Variadic list of values to be used to replace the format specifiers in fmt
+ *
+ * @return The length of the whole formatted string, which is larger than or
+ * equal to size if it was truncated.
+ */
+int debug_vsnprintf(char* buf, size_t size, const char* fmt, va_list args);
+
 /**
  * @brief Print a kernel log on all appropriate output devices, with formatting support.
  *
+ * @details Logs below LOGLEVEL_MIN are compiled out, logs below the threshold
+ * of LOG_SUBSYSTEM are discarded without evaluating the format arguments.
+ *
  * @param loglevel The log's loglevel. Must be a valid LOGLEVEL_* value. 
  * @param fmt The format string.
  * @param ... Sequence of values to be used to replace the format specifiers in fmt
  *
- * @return The number of printed characters.
+ * @return The number of printed characters, 0 if the log was discarded.
  */
-int debug_log(int loglevel, const char* fmt, ...);
+#ifdef CONFIG_BINLOG
+#define debug_log(loglevel, ...) ({ \
+	int __loglevel = (loglevel); \
+	debug_log_enabled(LOG_SUBSYSTEM, __loglevel) ? __debug_binlog(__loglevel, __VA_ARGS__) : 0; \
+})
+#else
+#define debug_log(loglevel, ...) ({ \
+	int __loglevel = (loglevel); \
+	debug_log_enabled(LOG_SUBSYSTEM, __loglevel) ? __debug_log(__loglevel, __VA_ARGS__) : 0; \
+})
+#endif
+
+/**
+ * @brief Internal debug_log() function. Should not be used.
+ */
+int __debug_log(int loglevel, const char* fmt, ...);
+
+#ifdef CONFIG_BINLOG
+
+/**
+ * @brief Send binary data to the debug console right away, bypassing the
+ * kernel log. Used for the binary log stream.
+ *
+ * @param data The data to be sent
+ * @param len Length of the data
+ */
+void debug_write_binary(const void* data, size_t len);
+
+/** @brief Internal binary logging macros. Should not be used. */
+#define __BINLOG_ARG(x) ((uint64_t)(uintptr_t)(x))
+
+#define __BINLOG_NARGS(...) __BINLOG_NARGS_(0, ##__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define __BINLOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, n, ...) n
+
+#define __BINLOG_ARGS0()
+#define __BINLOG_ARGS1(a) __BINLOG_ARG(a)
+#define __BINLOG_ARGS2(a, ...) __BINLOG_ARG(a), __BINLOG_ARGS1(__VA_ARGS__)
+#define __BINLOG_ARGS3(a, ...) __BINLOG_ARG(a), __BINLOG_ARGS2(__VA_ARGS__)
+#define __BINLOG_ARGS4(a, ...) __BINLOG_ARG(a), __BINLOG_ARGS3(__VA_ARGS__)
+#define __BINLOG_ARGS5(a, ...) __BINLOG_ARG(a), __BINLOG_ARGS4(__VA_ARGS__)
+#define __BINLOG_ARGS6(a, ...) __BINLOG_ARG(a), __BINLOG_ARGS5(__VA_ARGS__)
+#define __BINLOG_ARGS7(a, ...) __BINLOG_ARG(a), __BINLOG_ARGS6(__VA_ARGS__)
+#define __BINLOG_ARGS8(a, ...) __BINLOG_ARG(a), __BINLOG_ARGS7(__VA_ARGS__)
+#define __BINLOG_ARGS9(a, ...) __BINLOG_ARG(a), __BINLOG_ARGS8(__VA_ARGS__)
+#define __BINLOG_ARGS10(a, ...) __BINLOG_ARG(a), __BINLOG_ARGS9(__VA_ARGS__)
+#define __BINLOG_ARGS11(a, ...) __BINLOG_ARG(a), __BINLOG_ARGS10(__VA_ARGS__)
+#define __BINLOG_ARGS12(a, ...) __BINLOG_ARG(a), __BINLOG_ARGS11(__VA_ARGS__)
+#define __BINLOG_ARGS13(a, ...) __BINLOG_ARG(a), __BINLOG_ARGS12(__VA_ARGS__)
+#define __BINLOG_ARGS14(a, ...) __BINLOG_ARG(a), __BINLOG_ARGS13(__VA_ARGS__)
+#define __BINLOG_ARGS15(a, ...) __BINLOG_ARG(a), __BINLOG_ARGS14(__VA_ARGS__)
+#define __BINLOG_ARGS16(a, ...) __BINLOG_ARG(a), __BINLOG_ARGS15(__VA_ARGS__)
+
+#define __BINLOG_CAT(a, b) __BINLOG_CAT_(a, b)
+#define __BINLOG_CAT_(a, b) a##b
+
+/**
+ * @brief Internal binary debug_log() macro. Should not be used.
+ *
+ * @details The format string (which has to be a string literal) is stored in
+ * the .log_fmt section, only its offset and the arguments (at most 16) go into
+ * the log.
+ */
+#define __debug_binlog(loglevel, fmt, ...) ({ \
+	static const char __binlog_fmt[] __attribute__((section(".log_fmt"), aligned(1))) = fmt; \
+	const uint64_t __binlog_args[__BINLOG_NARGS(__VA_ARGS__) + 1] = { \
+		__BINLOG_CAT(__BINLOG_ARGS, __BINLOG_NARGS(__VA_ARGS__))(__VA_ARGS__) \
+	}; \
+	log_write_binary((loglevel), __binlog_fmt, __binlog_args, __BINLOG_NARGS(__VA_ARGS__)); \
+	0; \
+})
+
+/**
+ * @brief With CONFIG_BINLOG, debug_printf() with a string literal format is
+ * logged in binary as well. Always returns 0.
+ */
+#define debug_printf(...) __debug_binlog(LOGLEVEL_NONE, __VA_ARGS__)
+
+#endif
 
 /**
  * @brief Trigger a kernel panic.
@@ -0,0 +1,113 @@
+/**
+ * @file log.h
+ * @author Popa Vlad (Garnek0)
+ * @copyright BSD-2-Clause
+ *
+ * @brief
+ * Kernel log buffer.
+ */
+
+#pragma once
+
+#include <symphony/types.h>
+
+/**
+ * @brief Size of the log ring buffer of each CPU in bytes.
+ */
+#ifndef LOG_RING_SIZE
+#define LOG_RING_SIZE (64*1024)
+#endif
+
+/**
+ * @brief Largest amount of text stored in a single log record. debug_log()
+ * splits longer messages into several records.
+ */
+#ifndef LOG_LINE_MAX
+#define LOG_LINE_MAX 512
+#endif
+
+#ifdef CONFIG_BINLOG
+
+/** @brief Marks the start of every frame in the binary log stream ("SLOG"). */
+#define LOG_FRAME_MAGIC 0x474F4C53
+
+/**@{*/
+/** @brief Binary log frame types. */
+#define LOG_FRAME_TEXT 0
+#define LOG_FRAME_BINARY 1
+/**@}*/
+
+/**
+ * @brief Header of a frame in the binary log stream, followed by len bytes
+ * of payload. All fields are in the byte order of the CPU.
+ *
+ * @details The payload of a LOG_FRAME_TEXT frame is text. The payload of a
+ * LOG_FRAME_BINARY frame is a struct log_binary followed by the arguments.
+ */
+struct log_frame {
+	uint32_t magic;
+	uint16_t len;
+	uint8_t level;
+	uint8_t type;
+	uint64_t seq;
+	uint64_t timestamp;
+} __attribute__((packed));
+
+/**
+ * @brief Binary log record, followed by nargs 64 bit arguments. Arguments
+ * are converted to 64 bits at the call site, the format decides how many
+ * bits of them are used.
+ */
+struct log_binary {
+	/** @brief Offset of the format string from the start of .log_fmt. */
+	uint32_t format;
+	uint32_t nargs;
+} __attribute__((packed));
+
+/** @brief Start of the .log_fmt section, defined by the linker script. */
+extern const char __log_fmt_start[];
+
+/**
+ * @brief Append a binary record to the log buffer of the current CPU.
+ *
+ * @param loglevel LOGLEVEL_* value of the record
+ * @param format Format string, stored in the .log_fmt section
+ * @param args Arguments of the format string
+ * @param nargs Number of arguments
+ */
+void log_write_binary(int loglevel, const char* format, const uint64_t* args, size_t nargs);
+
+#endif
+
+/**
+ * @brief Append a record to the log buffer of the current CPU.
+ *
+ * @details Lock-free, so it can be used from any context. Unless the log is
+ * deferred, the record is also written out to the output devices right away.
+ * Records which do not fit in the log buffer are dropped (and counted).
+ *
+ * @param loglevel LOGLEVEL_* value of the record. LOGLEVEL_NONE records are
+ * printed without a prefix.
+ * @param text Text of the record, does not have to be null terminated
+ * @param len Length of the text, truncated to LOG_LINE_MAX
+ */
+void log_write(int loglevel, const char* text, size_t len);
+
+/**
+ * @brief Write the records of all CPUs out to the output devices, in the
+ * order they were logged.
+ *
+ * @param force Flush even if another CPU (or an interrupted context) is in
+ * the middle of a flush. Only meant for the panic path.
+ *
+ * @return true if anything was written out, false otherwise.
+ */
+bool log_flush(bool force);
+
+/**
+ * @brief Choose whether records are written out right away or only by
+ * log_flush().
+ *
+ * @param defer true to leave writing records out to log_flush()
+ */
+void log_set_deferred(bool defer);
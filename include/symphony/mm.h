@@ -38,6 +38,13 @@
  */
 #define VMM_USER (1 << 3)
 
+/**
+ * @brief Global page. The TLB entries of global pages survive address space
+ * switches, so this should only be used for kernel mappings shared by all
+ * address spaces.
+ */
+#define VMM_GLOBAL (1 << 4)
+
 /**
  * @brief Get the closest value greater than x aligned on the specified byte boundary.
  *
@@ -51,11 +58,138 @@
  */
 #define PAGE_SIZE 4096
 
+/**
+ * @brief 2MiB huge page size.
+ */
+#define HUGE_PAGE_SIZE_2M 0x200000
+
+/**
+ * @brief 1GiB huge page size.
+ */
+#define HUGE_PAGE_SIZE_1G 0x40000000
+
 /**
  * @brief Initial kernel heap size in pages.
  */
 #define KHEAP_INIT_PAGES 16
 
+/**
+ * @brief Amount of free kernel heap memory in bytes above which kfree() gives
+ * free pages back to the PMM.
+ */
+#ifndef KHEAP_TRIM_WATERMARK
+#define KHEAP_TRIM_WATERMARK (256 * PAGE_SIZE)
+#endif
+
+/**
+ * @brief kmalloc() sizes from which memory is allocated straight from the PMM
+ * instead of the kernel heap.
+ */
+#ifndef KHEAP_LARGE_THRESHOLD
+#define KHEAP_LARGE_THRESHOLD (2 * PAGE_SIZE)
+#endif
+
+/**
+ * @brief Maximum number of free pages kept in each per-CPU page cache.
+ */
+#ifndef PMM_PCP_SIZE
+#define PMM_PCP_SIZE 64
+#endif
+
+/**
+ * @brief Number of pages moved between a per-CPU page cache and the global
+ * allocator in one go.
+ */
+#ifndef PMM_PCP_BATCH
+#define PMM_PCP_BATCH 16
+#endif
+
+/**
+ * @brief Number of pre-zeroed pages the PMM tries to keep around.
+ */
+#ifndef PMM_ZERO_POOL_SIZE
+#define PMM_ZERO_POOL_SIZE 256
+#endif
+
+/**
+ * @brief Number of 2MiB huge pages reserved for pmm_alloc_huge() at boot.
+ */
+#ifndef PMM_HUGE_POOL_2M
+#define PMM_HUGE_POOL_2M 0
+#endif
+
+/**
+ * @brief Number of 1GiB huge pages reserved for pmm_alloc_huge() at boot.
+ */
+#ifndef PMM_HUGE_POOL_1G
+#define PMM_HUGE_POOL_1G 0
+#endif
+
+/**
+ * @brief pmm_alloc_flags() flag. Return zeroed out memory.
+ */
+#define PMM_ZERO 1
+
+/**
+ * @brief Largest block order handled by the buddy allocator. Order n blocks
+ * are 2^n pages long, so this gives us blocks of up to 1GiB.
+ */
+#define PMM_MAX_ORDER 18
+
+/** @brief Per-CPU page cache statistics. */
+struct pmm_pcp_stats {
+	/** @brief Single page allocations served from the cache. */
+	uint64_t hits;
+
+	/** @brief Single page allocations that had to refill the cache first. */
+	uint64_t misses;
+
+	/** @brief Number of times pages were drained back to the global allocator. */
+	uint64_t drains;
+
+	/** @brief Number of pages currently held by the cache. */
+	int count;
+};
+
+/** @brief Physical memory usage statistics. */
+struct pmm_stats {
+	/** @brief Number of usable pages handed to the PMM at boot. */
+	uint64_t totalPages;
+
+	/** @brief Number of pages on the buddy allocator free lists. */
+	uint64_t freePages;
+
+	/** @brief Number of free pages held by the page caches, the zeroed page pool and the huge page pools. */
+	uint64_t cachedPages;
+
+	/** @brief Size of the largest free block in pages. */
+	uint64_t largestFreeBlock;
+
+	/** @brief Number of free blocks of each order. */
+	uint64_t freeBlocks[PMM_MAX_ORDER + 1];
+};
+
+/** @brief Statistics of a single usable memory map region. */
+struct pmm_region_stats {
+	/** @brief Base physical address of the region. */
+	uint64_t base;
+
+	/** @brief Length of the region in bytes. */
+	uint64_t length;
+
+	/** @brief Number of free pages in the region. */
+	uint64_t freePages;
+
+	/**
+	 * @brief Number of allocated pages in the region. Pages held by the
+	 * caches and pools count as allocated.
+	 */
+	uint64_t usedPages;
+
+	/** @brief Longest run of contiguous free pages in the region. */
+	uint64_t largestFreeRun;
+};
+
 /**
  * @brief Initialize the physical memory manager.
  *
@@ -72,6 +206,50 @@ int pmm_init(void);
  */
 void* pmm_alloc(int pages);
 
+/**
+ * @brief Allocate physical memory pages, with allocation flags.
+ *
+ * @param pages Number of PAGE_SIZE pages to allocate.
+ * @param flags PMM_* allocation flags.
+ *
+ * @return Non-HHDM base address of the newly allocated memory
+ */
+void* pmm_alloc_flags(int pages, int flags);
+
+/**
+ * @brief Allocate physically contiguous, aligned memory pages.
+ *
+ * @param pages Number of PAGE_SIZE pages to allocate.
+ * @param alignment Alignment of the base address in bytes. Must be a power
+ * of two.
+ * @param flags PMM_* allocation flags.
+ *
+ * @return Non-HHDM base address of the newly allocated memory
+ */
+void* pmm_alloc_aligned(int pages, size_t alignment, int flags);
+
+/**
+ * @brief Allocate a huge page, preferably from the pools reserved at boot.
+ *
+ * @param size Huge page size. Must be either HUGE_PAGE_SIZE_2M or
+ * HUGE_PAGE_SIZE_1G.
+ * @param flags PMM_* allocation flags.
+ *
+ * @return Non-HHDM base address of the huge page, NULL if size is not a
+ * supported huge page size.
+ */
+void* pmm_alloc_huge(size_t size, int flags);
+
+/**
+ * @brief Deallocate a huge page allocated with pmm_alloc_huge().
+ *
+ * @param base Non-HHDM base address of the huge page.
+ * @param size Huge page size.
+ *
+ * @return 0 on success, negative error value on error.
+ */
+int pmm_free_huge(void* base, size_t size);
+
 /**
  * @brief Deallocate physical memory pages.
  *
@@ -81,14 +259,76 @@ void* pmm_alloc(int pages);
  * @warning This function does not check whether the memory to be deallocated 
  * has actually been previously allocated or not. This means that some 
  * very-hard-to-track-down oopsies may be introduced in the kernel if it is 
- * fed the wrong parameters. The Symphony PMM tries to make it easier to spot 
- * accidentally deallocated memory by setting all deallocated bytes to 0xFF 
- * (a common strategy).
+ * fed the wrong parameters. Kernels built with MM_DEBUG=1 catch pages freed
+ * twice and set all deallocated bytes to 0xFF (a common strategy), to make
+ * it easier to spot accidentally deallocated memory.
  *
  * @return 0 on success, negative error value on error.
  */
 int pmm_free(void* base, int pages);
 
+/**
+ * @brief Get the page cache statistics of a CPU.
+ *
+ * @param cpu The CPU to get the statistics of
+ * @param stats Structure to fill in
+ *
+ * @return 0 on success, negative error value on error.
+ */
+int pmm_pcp_stats(int cpu, struct pmm_pcp_stats* stats);
+
+/**
+ * @brief Zero out a free page and add it to the pre-zeroed page pool.
+ *
+ * @details Meant to be called whenever the CPU would otherwise be idle, so that
+ * PMM_ZERO allocations do not have to clear memory themselves.
+ *
+ * @return true if the pool still needs more pages, false otherwise.
+ */
+bool pmm_zero_idle(void);
+
+/**
+ * @brief Get the number of physical pages tracked by the PMM.
+ *
+ * @return Number of pages between physical address 0 and the end of the
+ * highest usable memory region (rounded up).
+ */
+uint64_t pmm_page_count(void);
+
+/**
+ * @brief Get the physical memory usage statistics.
+ *
+ * @param stats Structure to fill in
+ */
+void pmm_stats(struct pmm_stats* stats);
+
+/**
+ * @brief Get the fragmentation index of free memory for an allocation order.
+ *
+ * @param order Allocation order (the allocation is 2^order pages long)
+ *
+ * @return Free memory that is in blocks too small for the allocation, in
+ * thousandths of all free memory (0 means no fragmentation, 1000 means no
+ * block is large enough), negative error value on error.
+ */
+int pmm_fragmentation(int order);
+
+/**
+ * @brief Get the statistics of a usable memory map region.
+ *
+ * @param index Memory map entry index
+ * @param stats Structure to fill in
+ *
+ * @return 0 on success, negative error value on error (including if the
+ * entry is not usable memory).
+ */
+int pmm_region_stats(uint64_t index, struct pmm_region_stats* stats);
+
+/**
+ * @brief Log the physical memory usage statistics.
+ */
+void pmm_dump_stats(void);
+
 /**
  * @brief Initialize the virtual memory manager.
  *
@@ -103,6 +343,13 @@ inline void* vmm_new_pt(void) {
 	return arch_vmm_new_pt();
 }
 
+/**
+ * @brief Alias of arch_vmm_new_kernel_pt().
+ */
+inline void* vmm_new_kernel_pt(void) {
+	return arch_vmm_new_kernel_pt();
+}
+
 /**
  * @brief Alias of arch_vmm_destroy_pt().
  */
@@ -139,15 +386,46 @@ inline void vmm_set_flags(void* pageTable, uint64_t virtAddr, int flags) {
 }
 
 /**
- * @brief Map a physical address range to a virtual address range.
- *
- * @param pageTable Top-level page table, the context of this operation
- * @param physAddr Physical address, preferably page-aligned
- * @param virtAddr Virtual address, preferably page-aligned
- * @param size Range size in bytes
- * @param flags VMM flags 
+ * @brief Alias of arch_vmm_map_range().
+ */
+inline void vmm_map_range(void* pageTable, uint64_t physAddr, uint64_t virtAddr, size_t size, int flags) {
+	arch_vmm_map_range(pageTable, physAddr, virtAddr, size, flags);
+}
+
+/**
+ * @brief Alias of arch_vmm_unmap_range().
+ */
+inline void vmm_unmap_range(void* pageTable, uint64_t virtAddr, size_t size) {
+	arch_vmm_unmap_range(pageTable, virtAddr, size);
+}
+
+/**
+ * @brief Alias of arch_vmm_protect_range().
+ */
+inline void vmm_protect_range(void* pageTable, uint64_t virtAddr, size_t size, int flags) {
+	arch_vmm_protect_range(pageTable, virtAddr, size, flags);
+}
+
+/**
+ * @brief Alias of arch_clear_pages() for a single page.
+ */
+inline void clear_page(void* page) {
+	arch_clear_pages(page, 1);
+}
+
+/**
+ * @brief Alias of arch_clear_pages().
+ */
+inline void clear_pages(void* page, size_t pages) {
+	arch_clear_pages(page, pages);
+}
+
+/**
+ * @brief Alias of arch_copy_page().
  */
-void vmm_map_range(void* pageTable, uint64_t physAddr, uint64_t virtAddr, size_t size, int flags);
+inline void copy_page(void* dest, const void* src) {
+	arch_copy_page(dest, src);
+}
 
 /**
  * @brief Fetch kernel top-level page table.
@@ -156,6 +434,250 @@ void vmm_map_range(void* pageTable, uint64_t physAddr, uint64_t virtAddr, size_t
  */
 void* vmm_kernel_pt(void);
 
+/**
+ * @brief Default arena chunk size in pages.
+ */
+#ifndef ARENA_CHUNK_PAGES
+#define ARENA_CHUNK_PAGES 4
+#endif
+
+/**
+ * @brief Chunk of memory an arena allocates from.
+ */
+struct arena_chunk;
+
+/**
+ * @brief Bump allocator. Everything allocated from an arena is freed at once,
+ * by arena_reset(), arena_destroy() or the end of a scope.
+ */
+struct arena {
+	/** @brief Chunk currently being allocated from */
+	struct arena_chunk* chunk;
+	/** @brief Next free byte of the current chunk */
+	uint64_t pos;
+	/** @brief End of the current chunk */
+	uint64_t end;
+	/** @brief Size of new chunks in pages */
+	size_t chunkPages;
+};
+
+/**
+ * @brief Saved arena position. Ending the scope frees everything allocated
+ * since it began.
+ */
+struct arena_scope {
+	/** @brief The arena the scope belongs to */
+	struct arena* arena;
+	/** @brief Chunk the arena was allocating from when the scope began */
+	struct arena_chunk* chunk;
+	/** @brief Arena position when the scope began */
+	uint64_t pos;
+};
+
+/**
+ * @brief Initialize an arena. No memory is taken from the PMM until the first
+ * allocation. Arenas only depend on the PMM, so they can be used before
+ * kheap_init().
+ *
+ * @param arena The arena to initialize
+ * @param chunkPages Size of the chunks allocated from the PMM in pages, 0 for
+ * ARENA_CHUNK_PAGES
+ */
+void arena_init(struct arena* arena, size_t chunkPages);
+
+/**
+ * @brief Allocate memory from an arena.
+ *
+ * @param arena The arena to allocate from
+ * @param size Allocation size
+ * @param alignment Alignment in bytes, must be a power of two. 0 for the
+ * default alignment (16 bytes).
+ *
+ * @return Pointer to the newly allocated memory
+ */
+void* arena_alloc(struct arena* arena, size_t size, size_t alignment);
+
+/**
+ * @brief Free everything allocated from an arena. The first chunk is kept for
+ * future allocations, all others are given back to the PMM.
+ *
+ * @param arena The arena to reset
+ */
+void arena_reset(struct arena* arena);
+
+/**
+ * @brief Free everything allocated from an arena and give all of its memory
+ * back to the PMM.
+ *
+ * @param arena The arena to destroy
+ */
+void arena_destroy(struct arena* arena);
+
+/**
+ * @brief Begin an arena scope. Scopes can be nested, as long as they end in
+ * the reverse order they began in.
+ *
+ * @param arena The arena to begin the scope in
+ *
+ * @return The new scope
+ */
+struct arena_scope arena_scope_begin(struct arena* arena);
+
+/**
+ * @brief End an arena scope, freeing everything allocated since it began.
+ *
+ * @param scope The scope to end
+ */
+void arena_scope_end(struct arena_scope* scope);
+
+/**
+ * @brief Largest kmalloc() size served by the slab allocator size classes.
+ */
+#define SLAB_KMALLOC_MAX 512
+
+/**
+ * @brief Slab allocator object cache.
+ */
+struct kmem_cache;
+
+/**
+ * @brief Object cache statistics.
+ */
+struct kmem_cache_stats {
+	/** @brief Name of the cache */
+	const char* name;
+	/** @brief Size of each object, including alignment padding */
+	size_t objectSize;
+	/** @brief Number of slabs allocated */
+	size_t slabs;
+	/** @brief Total number of objects in all slabs */
+	size_t objects;
+	/** @brief Number of objects currently allocated */
+	size_t inUse;
+	/** @brief Number of free objects held by the per-CPU magazines */
+	size_t cached;
+	/** @brief Number of kmem_cache_alloc() calls */
+	uint64_t allocs;
+	/** @brief Number of kmem_cache_free() calls */
+	uint64_t frees;
+	/** @brief Number of objects freed on a CPU other than the one owning their slab */
+	uint64_t remoteFrees;
+};
+
+/**
+ * @brief Initialize the slab allocator.
+ *
+ * @return 0 on success, negative error value on error.
+ */
+int slab_init(void);
+
+/**
+ * @brief Create an object cache.
+ *
+ * @param name Name of the cache. Must stay valid for the lifetime of the cache.
+ * @param size Object size
+ * @param align Object alignment, 0 for the default (8 bytes)
+ * @param ctor Optional object constructor. It is called once for each object
+ * when a new slab is allocated, not on every allocation, so objects should be
+ * returned to the cache in their constructed state.
+ *
+ * @return Pointer to the new cache
+ */
+struct kmem_cache* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void* obj));
+
+/**
+ * @brief Destroy an object cache and give all of its slabs back to the PMM.
+ *
+ * @param cache The cache to destroy
+ */
+void kmem_cache_destroy(struct kmem_cache* cache);
+
+/**
+ * @brief Allocate an object from a cache.
+ *
+ * @param cache The cache to allocate from
+ *
+ * @return Pointer to the newly allocated object
+ */
+void* kmem_cache_alloc(struct kmem_cache* cache);
+
+/**
+ * @brief Free an object back to its cache.
+ *
+ * @param cache The cache the object was allocated from
+ * @param ptr Pointer to the object
+ */
+void kmem_cache_free(struct kmem_cache* cache, void* ptr);
+
+/**
+ * @brief Get the statistics of an object cache.
+ *
+ * @param cache The cache to get the statistics of
+ * @param stats Structure to fill in
+ */
+void kmem_cache_stats(struct kmem_cache* cache, struct kmem_cache_stats* stats);
+
+/**
+ * @brief Log the statistics of every object cache.
+ */
+void kmem_cache_dump_stats(void);
+
+/**
+ * @brief Allocate memory from the kmalloc() size class caches.
+ *
+ * @param size Allocation size, at most SLAB_KMALLOC_MAX
+ *
+ * @return Pointer to the newly allocated memory
+ */
+void* slab_kmalloc(size_t size);
+
+/**
+ * @brief Free memory if it belongs to a single-page slab.
+ *
+ * @param ptr Pointer to the memory to free
+ *
+ * @return true if the memory was freed, false if it was not allocated by the
+ * slab allocator.
+ */
+bool slab_kfree(void* ptr);
+
+/**
+ * @brief Number of buckets of the kmalloc() size histogram. Bucket n counts
+ * allocations of up to 16 << n bytes, the last one counts all larger ones.
+ */
+#define KHEAP_HISTOGRAM_BUCKETS 16
+
+/**
+ * @brief Kernel heap footprint.
+ */
+struct kheap_stats {
+	/** @brief Memory taken from the PMM in bytes */
+	size_t size;
+	/** @brief Memory usable for allocations (size minus block headers) */
+	size_t usable;
+	/** @brief Memory currently allocated */
+	size_t inUse;
+	/** @brief Largest size the heap has ever had */
+	size_t peakSize;
+	/** @brief Total memory given back to the PMM */
+	size_t released;
+	/** @brief Memory taken by allocations which bypass the heap */
+	size_t largeSize;
+	/** @brief Number of allocated blocks */
+	size_t usedBlocks;
+	/** @brief Number of free blocks */
+	size_t freeBlocks;
+	/** @brief Size of the largest free block */
+	size_t largestFree;
+	/**
+	 * @brief Free memory outside of the largest free block, in thousandths
+	 * of all free memory
+	 */
+	int fragmentation;
+	/** @brief Number of kmalloc() calls by size, see KHEAP_HISTOGRAM_BUCKETS */
+	uint64_t histogram[KHEAP_HISTOGRAM_BUCKETS];
+};
+
 /**
  * @brief Initialize kernel heap.
  *
@@ -187,6 +709,50 @@ void* kzalloc(size_t size);
  * @param ptr Pointer to the memory chunk to free
  *
  * @warning This function, just like pmm_free(), can corrupt the memory if used
- * incorrectly. It also poisons the blocks after deallocating them.
+ * incorrectly. Kernels built with MM_DEBUG=1 check for heap overflows, double
+ * frees and use after free, and poison the blocks after deallocating them.
  */
 void kfree(void* ptr);
+
+/**
+ * @brief Allocate an aligned chunk of memory.
+ *
+ * @param size The memory chunk size
+ * @param alignment Alignment in bytes, must be a power of two
+ *
+ * @return Pointer to the newly allocated memory chunk
+ */
+void* kmalloc_aligned(size_t size, size_t alignment);
+
+/**
+ * @brief Free a chunk of memory allocated with kmalloc_aligned().
+ *
+ * @param ptr Pointer to the memory chunk to free
+ */
+void kfree_aligned(void* ptr);
+
+/**
+ * @brief Give free kernel heap pages back to the PMM.
+ *
+ * @details Meant to be called from idle or memory reclaim contexts.
+ *
+ * @param keep Amount of free heap memory in bytes to keep around
+ *
+ * @return Number of bytes given back to the PMM
+ */
+size_t kheap_trim(size_t keep);
+
+/**
+ * @brief Get the kernel heap footprint.
+ *
+ * @param stats Structure to fill in
+ */
+void kheap_stats(struct kheap_stats* stats);
+
+/**
+ * @brief Log the kernel heap statistics.
+ *
+ * @details Kernels built with MM_DEBUG=1 also log the memory in use by each
+ * kmalloc() caller, which can be looked up with addr2line.
+ */
+void kheap_dump_stats(void);
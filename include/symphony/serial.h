@@ -11,6 +11,20 @@
 
 #include <symphony/types.h>
 
+/**
+ * @brief Baud rate of COM1. Must divide 115200.
+ */
+#ifndef SERIAL_BAUD
+#define SERIAL_BAUD 9600
+#endif
+
+/**
+ * @brief Size of the serial transmit queue in bytes.
+ */
+#ifndef SERIAL_TX_QUEUE_SIZE
+#define SERIAL_TX_QUEUE_SIZE 4096
+#endif
+
 /**
  * @brief Initialize serial COM1 for logging.
  *
@@ -18,6 +32,24 @@
  */
 int serial_init(void);
 
+/**
+ * @brief Drive the transmitter from the COM1 interrupt (IRQ 4) instead of
+ * polling. The interrupt has to be routed to serial_irq() first.
+ */
+void serial_enable_irq(void);
+
+/**
+ * @brief COM1 interrupt handler. Refills the transmit FIFO from the queue.
+ */
+void serial_irq(void);
+
+/**
+ * @brief Send out everything that is still queued by polling and switch to
+ * polled output for good. Later writes go straight to the UART without taking
+ * any locks. Used when the kernel is about to halt.
+ */
+void serial_sync(void);
+
 /**
  * @brief Print a character on the serial port.
  *
@@ -26,3 +58,13 @@ int serial_init(void);
  * @return The printed character 
  */
 char serial_char(char chr);
+
+/**
+ * @brief Print a chunk of text on the serial port.
+ *
+ * @param str The text to be printed, does not have to be null terminated
+ * @param len Length of the text
+ *
+ * @return The number of printed characters
+ */
+size_t serial_write(const char* str, size_t len);
@@ -0,0 +1,55 @@
+/**
+ * @file spinlock.h
+ * @author Popa Vlad (Garnek0)
+ * @copyright BSD-2-Clause
+ *
+ * @brief
+ * Simple spinlock implementation.
+ */
+
+#pragma once
+
+#include <symphony/types.h>
+
+/** @brief Spinlock structure. */
+struct spinlock {
+	/** @brief true if the lock is currently held. */
+	volatile bool locked;
+};
+
+/**
+ * @brief Static initializer for an unlocked spinlock.
+ */
+#define SPINLOCK_INIT { .locked = false }
+
+/**
+ * @brief Acquire a spinlock, spinning until it becomes available.
+ *
+ * @param lock The spinlock
+ */
+static inline void spinlock_acquire(struct spinlock* lock) {
+	while (__atomic_test_and_set(&lock->locked, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED))
+			continue;
+	}
+}
+
+/**
+ * @brief Try to acquire a spinlock without spinning.
+ *
+ * @param lock The spinlock
+ *
+ * @return true if the lock was acquired, false if it is held by someone else.
+ */
+static inline bool spinlock_try_acquire(struct spinlock* lock) {
+	return !__atomic_test_and_set(&lock->locked, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Release a previously acquired spinlock.
+ *
+ * @param lock The spinlock
+ */
+static inline void spinlock_release(struct spinlock* lock) {
+	__atomic_clear(&lock->locked, __ATOMIC_RELEASE);
+}
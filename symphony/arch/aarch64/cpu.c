@@ -0,0 +1,33 @@
+/*
+ * File: arch/aarch64/cpu.c
+ * 
+ * Authos(s): Popa Vlad (Garnek0)
+ *
+ * Copyright: BSD-2-Clause
+ *
+ * Description:
+ * aarch64 CPU identification.
+ */
+
+#include <symphony/arch/arch.h>
+
+int arch_cpu_current(void) {
+	// Only the bootstrap processor is brought up for now.
+	return 0;
+}
+
+uint64_t arch_timestamp(void) {
+	uint64_t value;
+
+	asm volatile("mrs %0, cntvct_el0" : "=r" (value));
+
+	return value;
+}
+
+uint64_t arch_timestamp_frequency(void) {
+	uint64_t value;
+
+	asm volatile("mrs %0, cntfrq_el0" : "=r" (value));
+
+	return value;
+}
@@ -0,0 +1,52 @@
+/*
+ * File: arch/aarch64/string.c
+ * 
+ * Authos(s): Popa Vlad (Garnek0)
+ *
+ * Copyright: BSD-2-Clause
+ *
+ * Description:
+ * aarch64 page clearing and copying primitives.
+ */
+
+#include <symphony/arch/arch.h>
+#include <symphony/mm.h>
+
+// DCZID_EL0 fields
+#define DCZID_BS_MASK 0xf
+#define DCZID_DZP (1 << 4)
+
+void arch_clear_pages(void* addr, size_t pages) {
+	uint64_t dczid;
+
+	asm volatile("mrs %0, dczid_el0" : "=r" (dczid));
+
+	// DC ZVA zeroes a whole block (usually a cache line) without reading it
+	// first. It may be prohibited, in which case fall back to memset().
+	if (dczid & DCZID_DZP) {
+		memset(addr, 0, pages * PAGE_SIZE);
+		return;
+	}
+
+	size_t block = (size_t)4 << (dczid & DCZID_BS_MASK);
+	uint64_t end = (uint64_t)addr + pages * PAGE_SIZE;
+
+	for (uint64_t p = (uint64_t)addr; p < end; p += block)
+		asm volatile("dc zva, %0" : : "r" (p) : "memory");
+}
+
+void arch_copy_page(void* dest, const void* src) {
+	uint64_t* d = (uint64_t*)dest;
+	const uint64_t* s = (const uint64_t*)src;
+
+	// STNP hints that the destination is not going to be accessed again
+	// soon, so it does not need to stay in the cache.
+	for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i += 4) {
+		asm volatile("ldp x2, x3, [%1]\n\t"
+			     "ldp x4, x5, [%1, #16]\n\t"
+			     "stnp x2, x3, [%0]\n\t"
+			     "stnp x4, x5, [%0, #16]"
+			     : : "r" (&d[i]), "r" (&s[i])
+			     : "x2", "x3", "x4", "x5", "memory");
+	}
+}
@@ -0,0 +1,31 @@
+/*
+ * File: arch/riscv64/cpu.c
+ * 
+ * Authos(s): Popa Vlad (Garnek0)
+ *
+ * Copyright: BSD-2-Clause
+ *
+ * Description:
+ * riscv64 CPU identification.
+ */
+
+#include <symphony/arch/arch.h>
+
+int arch_cpu_current(void) {
+	// Only the bootstrap processor is brought up for now.
+	return 0;
+}
+
+uint64_t arch_timestamp(void) {
+	uint64_t value;
+
+	asm volatile("rdtime %0" : "=r" (value));
+
+	return value;
+}
+
+uint64_t arch_timestamp_frequency(void) {
+	// The timebase frequency is only described by the device tree, which we
+	// do not parse yet.
+	return 0;
+}
@@ -0,0 +1,24 @@
+/*
+ * File: arch/riscv64/string.c
+ * 
+ * Authos(s): Popa Vlad (Garnek0)
+ *
+ * Copyright: BSD-2-Clause
+ *
+ * Description:
+ * riscv64 page clearing and copying primitives.
+ */
+
+#include <symphony/arch/arch.h>
+#include <symphony/mm.h>
+
+// The base ISA has no cache-bypassing stores (and Zicboz is optional), so
+// these are plain memset() and memcpy().
+
+void arch_clear_pages(void* addr, size_t pages) {
+	memset(addr, 0, pages * PAGE_SIZE);
+}
+
+void arch_copy_page(void* dest, const void* src) {
+	memcpy(dest, src, PAGE_SIZE);
+}
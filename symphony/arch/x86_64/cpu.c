@@ -0,0 +1,144 @@
+/*
+ * File: arch/x86_64/cpu.c
+ * 
+ * Authos(s): Popa Vlad (Garnek0)
+ *
+ * Copyright: BSD-2-Clause
+ *
+ * Description:
+ * x86 CPU identification and feature detection.
+ */
+
+#include <symphony/arch/arch.h>
+
+#define PIT_FREQUENCY 1193182
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND 0x43
+
+// Bit 0 gates PIT channel 2, bit 1 connects it to the speaker and bit 5
+// reads its output.
+#define PIT_GATE_PORT 0x61
+
+// How long to count TSC ticks for when calibrating against the PIT.
+#define TSC_CALIBRATION_MS 10
+
+// Bitmask of CPU_FEATURE_* values supported by the CPU.
+static uint64_t cpuFeatures;
+
+// TSC frequency in Hz, 0 until calibrated.
+static uint64_t tscFrequency;
+
+void arch_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+	asm volatile("cpuid"
+		: "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+		: "a" (leaf), "c" (subleaf));
+}
+
+void arch_cpu_detect_features(int cpu) {
+	uint32_t eax, ebx, ecx, edx;
+	uint32_t maxLeaf, maxExtLeaf;
+
+	(void)cpu;
+
+	arch_cpuid(0, 0, &maxLeaf, &ebx, &ecx, &edx);
+	arch_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+
+	if (ecx & (1 << 17))
+		cpuFeatures |= (1 << CPU_FEATURE_PCID);
+	if (edx & (1 << 13))
+		cpuFeatures |= (1 << CPU_FEATURE_PGE);
+
+	if (maxLeaf >= 7) {
+		arch_cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+
+		if (ebx & (1 << 9))
+			cpuFeatures |= (1 << CPU_FEATURE_ERMS);
+		if (edx & (1 << 4))
+			cpuFeatures |= (1 << CPU_FEATURE_FSRM);
+	}
+
+	arch_cpuid(0x80000000, 0, &maxExtLeaf, &ebx, &ecx, &edx);
+
+	if (maxExtLeaf >= 0x80000001) {
+		arch_cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+
+		if (edx & (1 << 26))
+			cpuFeatures |= (1 << CPU_FEATURE_PDPE1GB);
+	}
+}
+
+bool arch_cpu_has_feature(int feature) {
+	return cpuFeatures & ((uint64_t)1 << feature);
+}
+
+int arch_cpu_current(void) {
+	// Only the bootstrap processor is brought up for now.
+	return 0;
+}
+
+uint64_t arch_timestamp(void) {
+	uint32_t low, high;
+
+	asm volatile("rdtsc" : "=a" (low), "=d" (high));
+
+	return ((uint64_t)high << 32) | low;
+}
+
+// Count TSC ticks while PIT channel 2 counts down TSC_CALIBRATION_MS worth
+// of its own ticks.
+static uint64_t arch_tsc_calibrate_pit(void) {
+	uint16_t count = PIT_FREQUENCY / (1000 / TSC_CALIBRATION_MS);
+	uint8_t gate = arch_inb(PIT_GATE_PORT);
+	uint64_t start, end;
+
+	// Enable the gate, keep the speaker off.
+	arch_outb(PIT_GATE_PORT, (gate & ~0x02) | 0x01);
+
+	// Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count).
+	arch_outb(PIT_COMMAND, 0xB0);
+	arch_outb(PIT_CHANNEL2, count & 0xFF);
+	arch_outb(PIT_CHANNEL2, count >> 8);
+
+	start = arch_timestamp();
+
+	while (!(arch_inb(PIT_GATE_PORT) & 0x20))
+		continue;
+
+	end = arch_timestamp();
+
+	arch_outb(PIT_GATE_PORT, gate);
+
+	return (end - start) * (1000 / TSC_CALIBRATION_MS);
+}
+
+void arch_tsc_calibrate(void) {
+	uint32_t eax, ebx, ecx, edx;
+	uint32_t maxLeaf;
+
+	if (tscFrequency)
+		return;
+
+	arch_cpuid(0, 0, &maxLeaf, &ebx, &ecx, &edx);
+
+	// TSC/crystal clock ratio and crystal clock frequency.
+	if (maxLeaf >= 0x15) {
+		arch_cpuid(0x15, 0, &eax, &ebx, &ecx, &edx);
+
+		if (eax && ebx && ecx)
+			tscFrequency = (uint64_t)ecx * ebx / eax;
+	}
+
+	// Processor base frequency in MHz, which the TSC runs at.
+	if (!tscFrequency && maxLeaf >= 0x16) {
+		arch_cpuid(0x16, 0, &eax, &ebx, &ecx, &edx);
+
+		tscFrequency = (uint64_t)(eax & 0xFFFF) * 1000000;
+	}
+
+	if (!tscFrequency)
+		tscFrequency = arch_tsc_calibrate_pit();
+}
+
+uint64_t arch_timestamp_frequency(void) {
+	return tscFrequency;
+}
@@ -13,6 +13,10 @@
 
 int arch_init_very_early(int cpu) {
 	arch_load_gdt(cpu);
+	arch_cpu_detect_features(cpu);
+	arch_string_init();
+	arch_tsc_calibrate();
+	arch_tlb_init(cpu);
 	return 0;
 }
 
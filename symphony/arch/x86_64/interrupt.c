@@ -9,6 +9,8 @@
  * x86 interrupts.
  */
 
+#define LOG_SUBSYSTEM LOG_SUBSYS_ARCH
+
 #include <symphony/arch/arch.h>
 #include <symphony/debug.h>
 
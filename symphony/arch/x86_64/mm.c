@@ -14,74 +14,351 @@
 #include <symphony/boot_proto.h>
 #include <symphony/string.h>
 
-// Get all page table indexes given a virtual address.
-static void page_index(uint64_t virtAddr, int* Pi, int* PTi, int* PDi, int* PDPi) {
-	virtAddr >>= 12;
-	*Pi = virtAddr & 0x1ff;
-	virtAddr >>= 9;
-	*PTi = virtAddr & 0x1ff;
-	virtAddr >>= 9;
-	*PDi = virtAddr & 0x1ff;
-	virtAddr >>= 9;
-	*PDPi = virtAddr & 0x1ff;
-}
-
-// Get the pointer to a page table entry using page table indexes. This function
-// also allocates any missing page tables.
-static struct page_table_entry* page_from_index(struct page_table* pt, int Pi, int PTi, int PDi, int PDPi) {
-	struct page_table_entry currentEntry;
-
-	currentEntry = pt->entries[PDPi];
-	struct page_table* PDP;
-	if (!currentEntry.present) {
-		PDP = (struct page_table*)((uint64_t)pmm_alloc(1) + boot_proto_hhdm_offset());
-		memset((void*)PDP, 0, sizeof(struct page_table));
-
-		currentEntry.addr = (uint64_t)((uint64_t)PDP - boot_proto_hhdm_offset()) >> 12;
-		currentEntry.present = true;
-		currentEntry.readWrite = true;
-		currentEntry.userSupervisor = true;
-		pt->entries[PDPi] = currentEntry;
-	} else {
-		PDP = (struct page_table*)(((uint64_t)currentEntry.addr << 12) + boot_proto_hhdm_offset());
+// Number of PCIDs handed out to address spaces on each CPU. PCID 0 is left to
+// the page table set up by the bootloader.
+#define PCID_SLOTS 64
+
+// CR3 bit which keeps the TLB entries tagged with the new PCID.
+#define CR3_NOFLUSH ((uint64_t)1 << 63)
+
+// CR4 bits which enable global pages and PCIDs.
+#define CR4_PGE (1 << 7)
+#define CR4_PCIDE (1 << 17)
+
+// Index of the first top-level page table entry of the kernel half.
+#define KERNEL_HALF_START 256
+
+// An address space tagged with a PCID on a CPU. The PCID is the slot index + 1.
+struct pcid_slot {
+	struct page_table* pt;
+	uint64_t lastUsed;
+
+	// TLB entries tagged with this PCID may be out of date and must be
+	// flushed the next time the address space is switched to.
+	bool stale;
+};
+
+struct pcid_cpu {
+	struct pcid_slot slots[PCID_SLOTS];
+	uint64_t clock;
+
+	struct arch_tlb_stats stats;
+};
+
+static struct pcid_cpu pcidCPUs[MAX_CPUS];
+static bool pcidEnabled;
+
+// Kernel top-level page table. Its upper half is shared by all page tables.
+static struct page_table* kernelPML4;
+
+// Check whether a top-level page table is the one currently in use.
+static bool page_table_active(struct page_table* pt) {
+	uint64_t cr3;
+	asm volatile("mov %%cr3, %0" : "=r" (cr3));
+
+	return (cr3 & ~(uint64_t)0xfff) == (uint64_t)pt - boot_proto_hhdm_offset();
+}
+
+// Flush all non-global TLB entries if the page table is currently in use.
+// With PCIDs enabled, this only flushes the entries of the current PCID.
+static void page_table_flush(struct page_table* pt) {
+	if (page_table_active(pt)) {
+		uint64_t cr3;
+		asm volatile("mov %%cr3, %0; mov %0, %%cr3" : "=r" (cr3) :: "memory");
+
+		pcidCPUs[arch_cpu_current()].stats.flushes++;
 	}
+}
 
-	currentEntry = PDP->entries[PDi];
-	struct page_table* PD;
-	if (!currentEntry.present) {
-		PD = (struct page_table*)((uint64_t)pmm_alloc(1) + boot_proto_hhdm_offset());
-		memset((void*)PD, 0, sizeof(struct page_table));
+// Flush all TLB entries, including global ones.
+static void tlb_flush_global(void) {
+	uint64_t cr4;
+	asm volatile("mov %%cr4, %0" : "=r" (cr4));
 
-		currentEntry.addr = (uint64_t)((uint64_t)PD - boot_proto_hhdm_offset()) >> 12;
-		currentEntry.present = true;
-		currentEntry.readWrite = true;
-		currentEntry.userSupervisor = true;
-		PDP->entries[PDi] = currentEntry;
+	if (cr4 & CR4_PGE) {
+		// Toggling CR4.PGE flushes the entire TLB, for all PCIDs.
+		asm volatile("mov %0, %%cr4; mov %1, %%cr4" : : "r" (cr4 & ~(uint64_t)CR4_PGE), "r" (cr4) : "memory");
 	} else {
-		PD = (struct page_table*)(((uint64_t)currentEntry.addr << 12) + boot_proto_hhdm_offset());
+		uint64_t cr3;
+		asm volatile("mov %%cr3, %0; mov %0, %%cr3" : "=r" (cr3) :: "memory");
 	}
 
-	currentEntry = PD->entries[PTi];
-	struct page_table* PT;
-	if (!currentEntry.present) {
-		PT = (struct page_table*)((uint64_t)pmm_alloc(1) + boot_proto_hhdm_offset());
-		memset((void*)PT, 0, sizeof(struct page_table));
+	pcidCPUs[arch_cpu_current()].stats.flushes++;
+}
 
-		currentEntry.addr = (uint64_t)((uint64_t)PT - boot_proto_hhdm_offset()) >> 12;
-		currentEntry.present = true;
-		currentEntry.readWrite = true;
-		currentEntry.userSupervisor = true;
-		PD->entries[PTi] = currentEntry;
-	} else {
-		PT = (struct page_table*)(((uint64_t)currentEntry.addr << 12) + boot_proto_hhdm_offset());
+// Mark the TLB entries of a page table as out of date on every CPU except
+// skipCPU (which has already invalidated them itself).
+static void pcid_invalidate(struct page_table* pt, int skipCPU) {
+	if (!pcidEnabled)
+		return;
+
+	for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		if (cpu == skipCPU)
+			continue;
+
+		for (int i = 0; i < PCID_SLOTS; i++) {
+			if (pcidCPUs[cpu].slots[i].pt == pt)
+				__atomic_store_n(&pcidCPUs[cpu].slots[i].stale, true, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+// Find the PCID slot of a page table on a CPU. If the page table has no PCID
+// yet, an unused slot (or the least recently used one) is recycled.
+static struct pcid_slot* pcid_get(struct pcid_cpu* cpu, struct page_table* pt) {
+	struct pcid_slot* victim = &cpu->slots[0];
+
+	for (int i = 0; i < PCID_SLOTS; i++) {
+		if (cpu->slots[i].pt == pt)
+			return &cpu->slots[i];
+
+		if (victim->pt && (!cpu->slots[i].pt || cpu->slots[i].lastUsed < victim->lastUsed))
+			victim = &cpu->slots[i];
+	}
+
+	// The TLB may still hold entries of the previous owner of the PCID.
+	victim->pt = pt;
+	victim->stale = true;
+
+	return victim;
+}
+
+// Apply VMM flags to a page table entry.
+static void entry_set_flags(struct page_table_entry* pte, int flags) {
+	pte->present = (flags & VMM_PRESENT);
+	pte->readWrite = (flags & VMM_RW);
+	pte->userSupervisor = (flags & VMM_USER);
+	pte->nx = !(flags & VMM_EXEC);
+	pte->global = (flags & VMM_GLOBAL);
+}
+
+// Get the page table an entry points to, allocating it if the entry is not
+// present. If the entry maps a large page, the large page gets split into a
+// page table of smaller pages (each childPages 4KiB pages long) which map the
+// same memory with the same flags.
+static struct page_table* page_table_from_entry(struct page_table_entry* entry, uint64_t childPages) {
+	if (entry->present && !entry->pageSize)
+		return (struct page_table*)(((uint64_t)entry->addr << 12) + boot_proto_hhdm_offset());
+
+	struct page_table* table = (struct page_table*)((uint64_t)pmm_alloc_flags(1, PMM_ZERO) + boot_proto_hhdm_offset());
+
+	if (entry->present) {
+		for (int i = 0; i < 512; i++) {
+			table->entries[i] = *entry;
+			table->entries[i].addr = entry->addr + i*childPages;
+			table->entries[i].pageSize = (childPages > 1);
+		}
+	}
+
+	struct page_table_entry newEntry = {0};
+
+	newEntry.addr = (uint64_t)((uint64_t)table - boot_proto_hhdm_offset()) >> 12;
+	newEntry.present = true;
+	newEntry.readWrite = true;
+	newEntry.userSupervisor = true;
+	*entry = newEntry;
+
+	return table;
+}
+
+// Free a page table along with all the page tables below it. levels is the
+// number of page table levels below this one.
+static void page_table_free(struct page_table* table, int levels) {
+	for (int i = 0; levels && i < 512; i++) {
+		if (table->entries[i].present && !table->entries[i].pageSize)
+			page_table_free((struct page_table*)(((uint64_t)table->entries[i].addr << 12) + boot_proto_hhdm_offset()), levels - 1);
+	}
+
+	pmm_free((void*)((uint64_t)table - boot_proto_hhdm_offset()), 1);
+}
+
+// Range operations for page_table_walk().
+#define WALK_MAP 0
+#define WALK_UNMAP 1
+#define WALK_PROTECT 2
+
+// Ranges with more pages than this that need TLB invalidation get a full TLB
+// flush instead of one invlpg per page.
+#define WALK_INVLPG_MAX 32
+
+// State of a range operation.
+struct page_table_walk {
+	int op;
+	int flags;
+
+	// Physical address to map the next page to.
+	uint64_t physAddr;
+
+	// Virtual address range which needs TLB invalidation.
+	uint64_t flushStart;
+	uint64_t flushEnd;
+
+	// Whether any of the entries which need invalidation were global.
+	bool flushGlobal;
+};
+
+// Shift of the virtual address range covered by a single entry at each page
+// table level, starting from the top-level page table.
+static const int levelShift[4] = { 39, 30, 21, 12 };
+
+// Check whether a large page can be mapped by an entry at a page table level.
+static bool page_table_level_large(int level) {
+	return level == 2 || (level == 1 && arch_cpu_has_feature(CPU_FEATURE_PDPE1GB));
+}
+
+// Add a range to the range that needs TLB invalidation.
+static void page_table_walk_invalidate(struct page_table_walk* walk, uint64_t virtAddr, uint64_t size) {
+	if (walk->flushStart == walk->flushEnd) {
+		walk->flushStart = virtAddr;
+		walk->flushEnd = virtAddr + size;
+		return;
+	}
+
+	if (virtAddr < walk->flushStart)
+		walk->flushStart = virtAddr;
+	if (virtAddr + size > walk->flushEnd)
+		walk->flushEnd = virtAddr + size;
+}
+
+// Apply a range operation to a leaf entry (either a 4KiB page or a large page
+// covered entirely by the range).
+static void page_table_walk_leaf(struct page_table_entry* entry, int level, uint64_t virtAddr, uint64_t size, struct page_table_walk* walk) {
+	if (entry->present) {
+		page_table_walk_invalidate(walk, virtAddr, size);
+		if (entry->global)
+			walk->flushGlobal = true;
+	}
+
+	switch (walk->op) {
+		case WALK_MAP: {
+			struct page_table_entry newEntry = {0};
+
+			newEntry.addr = walk->physAddr >> 12;
+			newEntry.pageSize = (level != 3);
+			entry_set_flags(&newEntry, walk->flags);
+			*entry = newEntry;
+			break;
+		}
+		case WALK_UNMAP:
+			entry->present = 0;
+			entry->addr = 0;
+			break;
+		case WALK_PROTECT:
+			// Leave pages that were never mapped alone.
+			if (entry->present || entry->addr)
+				entry_set_flags(entry, walk->flags);
+			break;
+	}
+
+	walk->physAddr += size;
+}
+
+// Apply a range operation to a range of virtual memory. The whole operation
+// descends the page table tree only once, filling consecutive entries of each
+// table and moving on to the next table only when the range crosses into it.
+static void page_table_walk(struct page_table* table, int level, uint64_t virtAddr, uint64_t size, struct page_table_walk* walk) {
+	uint64_t entrySize = (uint64_t)1 << levelShift[level];
+	int i = (virtAddr >> levelShift[level]) & 0x1ff;
+
+	while (size) {
+		struct page_table_entry* entry = &table->entries[i];
+
+		uint64_t chunk = entrySize - (virtAddr & (entrySize - 1));
+		if (chunk > size)
+			chunk = size;
+
+		bool whole = (chunk == entrySize);
+
+		if (level == 3 || (whole && entry->pageSize && walk->op != WALK_MAP)) {
+			page_table_walk_leaf(entry, level, virtAddr, chunk, walk);
+		} else if (walk->op == WALK_MAP && whole && page_table_level_large(level) && !(walk->physAddr & (entrySize - 1))) {
+			// Map a large page, getting rid of any page tables that used to
+			// map this range.
+			if (entry->present && !entry->pageSize) {
+				page_table_free((struct page_table*)(((uint64_t)entry->addr << 12) + boot_proto_hhdm_offset()), 2 - level);
+				page_table_walk_invalidate(walk, virtAddr, chunk);
+				walk->flushGlobal = true;
+				entry->present = false;
+			}
+
+			page_table_walk_leaf(entry, level, virtAddr, chunk, walk);
+		} else if (walk->op == WALK_MAP || entry->present) {
+			struct page_table* child = page_table_from_entry(entry, level == 1 ? 512 : 1);
+			page_table_walk(child, level + 1, virtAddr, chunk, walk);
+		} else {
+			walk->physAddr += chunk;
+		}
+
+		virtAddr += chunk;
+		size -= chunk;
+		i++;
+	}
+}
+
+// Start a range operation and do the required TLB invalidation afterwards.
+static void page_table_walk_range(struct page_table* pt, uint64_t virtAddr, uint64_t size, struct page_table_walk* walk) {
+	if (size % PAGE_SIZE != 0)
+		size = ALIGN_UP(size, PAGE_SIZE);
+
+	walk->flushStart = walk->flushEnd = 0;
+	walk->flushGlobal = false;
+
+	page_table_walk(pt, 0, virtAddr, size, walk);
+
+	if (walk->flushStart == walk->flushEnd)
+		return;
+
+	// The kernel half is shared by all page tables, so changes to it always
+	// need to be invalidated, whichever page table is active.
+	bool kernelHalf = ((virtAddr >> 39) & 0x1ff) >= KERNEL_HALF_START;
+
+	if (!kernelHalf && !page_table_active(pt)) {
+		pcid_invalidate(pt, -1);
+		return;
+	}
+
+	if (!kernelHalf)
+		pcid_invalidate(pt, arch_cpu_current());
+
+	// invlpg only reaches global entries and those of the current PCID. Stale
+	// non-global kernel translations and paging-structure caches can be left
+	// behind under any other PCID, so drop everything.
+	if (kernelHalf && pcidEnabled) {
+		tlb_flush_global();
+		return;
 	}
 
-	return &PT->entries[Pi];
+	if (walk->flushEnd - walk->flushStart > WALK_INVLPG_MAX * PAGE_SIZE) {
+		if (walk->flushGlobal || kernelHalf)
+			tlb_flush_global();
+		else
+			page_table_flush(pt);
+		return;
+	}
+
+	for (uint64_t addr = walk->flushStart; addr < walk->flushEnd; addr += PAGE_SIZE)
+		asm volatile("invlpg (%0)" :: "r"(addr) : "memory");
 }
 
 void* arch_vmm_new_pt(void) {
-	struct page_table* pt = (struct page_table*)((uint64_t)pmm_alloc(1) + boot_proto_hhdm_offset());
-	memset((void*)pt, 0, sizeof(struct page_table));
+	struct page_table* pt = (struct page_table*)((uint64_t)pmm_alloc_flags(1, PMM_ZERO) + boot_proto_hhdm_offset());
+
+	// Share the kernel half by reference. Since all of its top-level entries
+	// are allocated up front, anything mapped in the kernel half later on
+	// shows up in every page table.
+	if (kernelPML4)
+		memcpy(&pt->entries[KERNEL_HALF_START], &kernelPML4->entries[KERNEL_HALF_START], (512 - KERNEL_HALF_START) * sizeof(struct page_table_entry));
+
+	return (void*)pt;
+}
+
+void* arch_vmm_new_kernel_pt(void) {
+	struct page_table* pt = (struct page_table*)((uint64_t)pmm_alloc_flags(1, PMM_ZERO) + boot_proto_hhdm_offset());
+
+	for (int i = KERNEL_HALF_START; i < 512; i++)
+		page_table_from_entry(&pt->entries[i], 0);
+
+	kernelPML4 = pt;
 
 	return (void*)pt;
 }
@@ -96,12 +373,12 @@ void arch_vmm_destroy_pt(void* pageTable) {
 			PDP = (struct page_table*)((pt->entries[i].addr << 12) + boot_proto_hhdm_offset());
 
 			for (int j = 0; j < 512; j++) {
-				if (PDP && PDP->entries[j].present) {
+				if (PDP && PDP->entries[j].present && !PDP->entries[j].pageSize) {
 					struct page_table* PD;
 					PD = (struct page_table*)((PDP->entries[j].addr << 12) + boot_proto_hhdm_offset());
 
 					for (int k = 0; k < 512; k++) {
-						if (PD && PD->entries[k].present) {
+						if (PD && PD->entries[k].present && !PD->entries[k].pageSize) {
 							struct page_table* PT;
 							PT = (struct page_table*)((PD->entries[k].addr << 12) + boot_proto_hhdm_offset());
 
@@ -126,51 +403,108 @@ void arch_vmm_destroy_pt(void* pageTable) {
 		}
 	}
 
+	// Give back the PCIDs of the page table. Whoever gets them next will
+	// flush them first.
+	for (int cpu = 0; pcidEnabled && cpu < MAX_CPUS; cpu++) {
+		for (int i = 0; i < PCID_SLOTS; i++) {
+			if (pcidCPUs[cpu].slots[i].pt == pt) {
+				pcidCPUs[cpu].slots[i].pt = NULL;
+				pcidCPUs[cpu].slots[i].lastUsed = 0;
+			}
+		}
+	}
+
 	pmm_free((void*)((uint64_t)pt - boot_proto_hhdm_offset()), 1);
 }
 
 void arch_vmm_switch(void* pageTable) {
-	struct page_table* pt = (struct page_table*)((uint64_t)pageTable - boot_proto_hhdm_offset());
-	asm volatile("mov %0, %%cr3" : : "r" (pt));
-}
+	struct pcid_cpu* cpu = &pcidCPUs[arch_cpu_current()];
+	uint64_t cr3 = (uint64_t)pageTable - boot_proto_hhdm_offset();
 
-void arch_vmm_map(void* pageTable, uint64_t physAddr, uint64_t virtAddr, int flags) {
-	struct page_table* pt = (struct page_table*)pageTable;
+	cpu->stats.switches++;
 
-	int Pi, PTi, PDi, PDPi;
-	page_index(virtAddr, &Pi, &PTi, &PDi, &PDPi);
+	if (!pcidEnabled) {
+		cpu->stats.flushes++;
+		asm volatile("mov %0, %%cr3" : : "r" (cr3) : "memory");
+		return;
+	}
+
+	struct pcid_slot* slot = pcid_get(cpu, (struct page_table*)pageTable);
+	slot->lastUsed = ++cpu->clock;
 
-	struct page_table_entry* pte = page_from_index(pt, Pi, PTi, PDi, PDPi); 
+	cr3 |= (uint64_t)(slot - cpu->slots) + 1;
+
+	// Keep the TLB entries of the PCID unless they were invalidated while
+	// the address space was not active.
+	if (__atomic_exchange_n(&slot->stale, false, __ATOMIC_ACQ_REL)) {
+		cpu->stats.flushes++;
+	} else {
+		cr3 |= CR3_NOFLUSH;
+		cpu->stats.noFlushSwitches++;
+	}
 
-	pte->addr = (uint64_t)physAddr >> 12;
-	arch_vmm_set_flags(pt, virtAddr, flags);
+	asm volatile("mov %0, %%cr3" : : "r" (cr3) : "memory");
 }
 
-void arch_vmm_unmap(void* pageTable, uint64_t virtAddr) {
-	struct page_table* pt = (struct page_table*)pageTable;
+void arch_tlb_init(int cpu) {
+	uint64_t cr3, cr4;
+
+	(void)cpu;
+
+	asm volatile("mov %%cr3, %0" : "=r" (cr3));
+	asm volatile("mov %%cr4, %0" : "=r" (cr4));
+
+	if (arch_cpu_has_feature(CPU_FEATURE_PGE))
+		cr4 |= CR4_PGE;
+
+	// CR4.PCIDE can only be set while the current PCID is 0.
+	if (arch_cpu_has_feature(CPU_FEATURE_PCID) && !(cr3 & 0xfff)) {
+		cr4 |= CR4_PCIDE;
+		pcidEnabled = true;
+	}
 
-	int Pi, PTi, PDi, PDPi;
-	page_index(virtAddr, &Pi, &PTi, &PDi, &PDPi);
+	asm volatile("mov %0, %%cr4" : : "r" (cr4) : "memory");
+}
 
-	struct page_table_entry* pte = page_from_index(pt, Pi, PTi, PDi, PDPi);
+void arch_tlb_stats(int cpu, struct arch_tlb_stats* stats) {
+	*stats = pcidCPUs[cpu].stats;
+}
 
-	pte->present = 0;
-	pte->addr = 0;
+void arch_vmm_map(void* pageTable, uint64_t physAddr, uint64_t virtAddr, int flags) {
+	arch_vmm_map_range(pageTable, physAddr, virtAddr, PAGE_SIZE, flags);
+}
 
-	asm("invlpg (%0)" :: "r"(virtAddr) : "memory");
+void arch_vmm_unmap(void* pageTable, uint64_t virtAddr) {
+	arch_vmm_unmap_range(pageTable, virtAddr, PAGE_SIZE);
 }
 
 void arch_vmm_set_flags(void* pageTable, uint64_t virtAddr, int flags) {
-	struct page_table* pt = (struct page_table*)pageTable;
+	arch_vmm_protect_range(pageTable, virtAddr, PAGE_SIZE, flags);
+}
+
+void arch_vmm_map_range(void* pageTable, uint64_t physAddr, uint64_t virtAddr, size_t size, int flags) {
+	struct page_table_walk walk = {
+		.op = WALK_MAP,
+		.flags = flags,
+		.physAddr = physAddr
+	};
 
-	int Pi, PTi, PDi, PDPi;
-	page_index(virtAddr, &Pi, &PTi, &PDi, &PDPi);
+	page_table_walk_range((struct page_table*)pageTable, virtAddr, size, &walk);
+}
 
-	struct page_table_entry* pte = page_from_index(pt, Pi, PTi, PDi, PDPi);
+void arch_vmm_unmap_range(void* pageTable, uint64_t virtAddr, size_t size) {
+	struct page_table_walk walk = {
+		.op = WALK_UNMAP
+	};
 
-	pte->present = (flags & VMM_PRESENT);
-	pte->readWrite = (flags & VMM_RW);
-	pte->userSupervisor = (flags & VMM_USER);
-	pte->pageSize = false;
-	pte->nx = !(flags & VMM_EXEC);
+	page_table_walk_range((struct page_table*)pageTable, virtAddr, size, &walk);
+}
+
+void arch_vmm_protect_range(void* pageTable, uint64_t virtAddr, size_t size, int flags) {
+	struct page_table_walk walk = {
+		.op = WALK_PROTECT,
+		.flags = flags
+	};
+
+	page_table_walk_range((struct page_table*)pageTable, virtAddr, size, &walk);
 }
@@ -0,0 +1,190 @@
+/*
+ * File: arch/x86_64/string.c
+ * 
+ * Authos(s): Popa Vlad (Garnek0)
+ *
+ * Copyright: BSD-2-Clause
+ *
+ * Description:
+ * x86_64 memcpy, memset and memmove, built on the string instructions. The
+ * generic versions in string.c are not built for x86_64. Also has the page
+ * clearing and copying primitives.
+ */
+
+#include <symphony/arch/arch.h>
+#include <symphony/mm.h>
+
+// Unaligned accesses are fine on x86, these just keep the compiler from
+// making assumptions about alignment and aliasing.
+typedef uint64_t __attribute__((may_alias, aligned(1))) string_u64;
+typedef uint32_t __attribute__((may_alias, aligned(1))) string_u32;
+typedef uint16_t __attribute__((may_alias, aligned(1))) string_u16;
+
+// Sizes up to this are handled with a couple of (possibly overlapping) moves.
+#define STRING_SMALL_SIZE 16
+
+// Without FSRM, rep movsb/stosb have a startup cost which only pays off for
+// larger sizes. Below this, the qword variants are used instead.
+#define STRING_REP_BYTE_MIN 256
+
+// Set by arch_string_init(). Until then, only the qword variants are used,
+// which work on every x86_64 CPU.
+static bool haveERMS;
+static bool haveFSRM;
+
+void arch_string_init(void) {
+	haveERMS = arch_cpu_has_feature(CPU_FEATURE_ERMS);
+	haveFSRM = arch_cpu_has_feature(CPU_FEATURE_FSRM);
+}
+
+// Check whether a copy or fill of n bytes should use rep movsb/stosb.
+static inline bool string_use_rep_byte(size_t n) {
+	return haveERMS && (haveFSRM || n >= STRING_REP_BYTE_MIN);
+}
+
+// Copy up to STRING_SMALL_SIZE bytes. Everything is loaded before anything is
+// stored, so this is safe for overlapping buffers too.
+static inline void string_copy_small(uint8_t* dest, const uint8_t* src, size_t n) {
+	if (n >= 8) {
+		uint64_t head = *(const string_u64*)src;
+		uint64_t tail = *(const string_u64*)(src + n - 8);
+		*(string_u64*)dest = head;
+		*(string_u64*)(dest + n - 8) = tail;
+	} else if (n >= 4) {
+		uint32_t head = *(const string_u32*)src;
+		uint32_t tail = *(const string_u32*)(src + n - 4);
+		*(string_u32*)dest = head;
+		*(string_u32*)(dest + n - 4) = tail;
+	} else if (n >= 2) {
+		uint16_t head = *(const string_u16*)src;
+		uint16_t tail = *(const string_u16*)(src + n - 2);
+		*(string_u16*)dest = head;
+		*(string_u16*)(dest + n - 2) = tail;
+	} else if (n) {
+		*dest = *src;
+	}
+}
+
+// Copy more than STRING_SMALL_SIZE bytes, front to back.
+static inline void string_copy_forward(uint8_t* dest, const uint8_t* src, size_t n) {
+	if (string_use_rep_byte(n)) {
+		asm volatile("rep movsb" : "+D" (dest), "+S" (src), "+c" (n) : : "memory");
+		return;
+	}
+
+	// Copy whole qwords, then the last 8 bytes (which may overlap with what
+	// was already copied). The tail is loaded first in case the buffers
+	// overlap.
+	uint64_t tail = *(const string_u64*)(src + n - 8);
+	uint8_t* end = dest + n - 8;
+	size_t qwords = n / 8;
+
+	asm volatile("rep movsq" : "+D" (dest), "+S" (src), "+c" (qwords) : : "memory");
+
+	*(string_u64*)end = tail;
+}
+
+// Copy more than STRING_SMALL_SIZE bytes, back to front.
+static inline void string_copy_backward(uint8_t* dest, const uint8_t* src, size_t n) {
+	// Backward string operations are never fast strings, so always move
+	// qwords. The first 8 bytes are done separately, like the tail above.
+	uint64_t head = *(const string_u64*)src;
+	uint8_t* destEnd = dest + n - 8;
+	const uint8_t* srcEnd = src + n - 8;
+	size_t qwords = n / 8;
+
+	asm volatile("std\n\trep movsq\n\tcld" : "+D" (destEnd), "+S" (srcEnd), "+c" (qwords) : : "memory");
+
+	*(string_u64*)dest = head;
+}
+
+void* memcpy(void* dest, const void* src, size_t n) {
+	if (n <= STRING_SMALL_SIZE)
+		string_copy_small(dest, src, n);
+	else
+		string_copy_forward(dest, src, n);
+
+	return dest;
+}
+
+void* memset(void* s, int c, size_t n) {
+	uint8_t* p = (uint8_t*)s;
+	uint64_t pattern = (uint8_t)c * 0x0101010101010101;
+
+	if (n <= STRING_SMALL_SIZE) {
+		if (n >= 8) {
+			*(string_u64*)p = pattern;
+			*(string_u64*)(p + n - 8) = pattern;
+		} else if (n >= 4) {
+			*(string_u32*)p = (uint32_t)pattern;
+			*(string_u32*)(p + n - 4) = (uint32_t)pattern;
+		} else {
+			for (size_t i = 0; i < n; i++)
+				p[i] = (uint8_t)c;
+		}
+
+		return s;
+	}
+
+	if (string_use_rep_byte(n)) {
+		asm volatile("rep stosb" : "+D" (p), "+c" (n) : "a" (c) : "memory");
+		return s;
+	}
+
+	uint8_t* end = p + n - 8;
+	size_t qwords = n / 8;
+
+	asm volatile("rep stosq" : "+D" (p), "+c" (qwords) : "a" (pattern) : "memory");
+
+	*(string_u64*)end = pattern;
+
+	return s;
+}
+
+void* memmove(void* dest, const void* src, size_t n) {
+	if (n <= STRING_SMALL_SIZE)
+		string_copy_small(dest, src, n);
+	else if ((uint64_t)dest - (uint64_t)src >= n)
+		string_copy_forward(dest, src, n);
+	else
+		string_copy_backward(dest, src, n);
+
+	return dest;
+}
+
+// Whole pages are written with non-temporal stores. A freshly cleared or
+// copied page is rarely read back right away, so there is no point in
+// pulling it into the cache (and evicting something else).
+
+void arch_clear_pages(void* addr, size_t pages) {
+	uint64_t* p = (uint64_t*)addr;
+	size_t qwords = pages * (PAGE_SIZE / sizeof(uint64_t));
+
+	for (size_t i = 0; i < qwords; i += 4) {
+		asm volatile("movnti %4, %0\n\t"
+			     "movnti %4, %1\n\t"
+			     "movnti %4, %2\n\t"
+			     "movnti %4, %3"
+			     : "=m" (p[i]), "=m" (p[i + 1]), "=m" (p[i + 2]), "=m" (p[i + 3])
+			     : "r" ((uint64_t)0));
+	}
+
+	// Non-temporal stores are weakly ordered.
+	asm volatile("sfence" : : : "memory");
+}
+
+void arch_copy_page(void* dest, const void* src) {
+	uint64_t* d = (uint64_t*)dest;
+	const uint64_t* s = (const uint64_t*)src;
+
+	for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i += 4) {
+		asm volatile("movnti %4, %0\n\t"
+			     "movnti %5, %1\n\t"
+			     "movnti %6, %2\n\t"
+			     "movnti %7, %3"
+			     : "=m" (d[i]), "=m" (d[i + 1]), "=m" (d[i + 2]), "=m" (d[i + 3])
+			     : "r" (s[i]), "r" (s[i + 1]), "r" (s[i + 2]), "r" (s[i + 3]));
+	}
+
+	asm volatile("sfence" : : : "memory");
+}
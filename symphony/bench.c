@@ -0,0 +1,133 @@
+/*
+ * File: bench.c
+ * 
+ * Authos(s): Popa Vlad (Garnek0)
+ *
+ * Copyright: BSD-2-Clause
+ *
+ * Description:
+ * Boot time micro-benchmarks for the memory allocators and memory functions.
+ */
+
+#ifdef CONFIG_BENCH
+
+#include <symphony/bench.h>
+#include <symphony/debug.h>
+#include <symphony/mm.h>
+#include <symphony/string.h>
+#include <symphony/boot_proto.h>
+#include <symphony/arch/arch.h>
+
+#define BENCH_ROUNDS 256
+#define BENCH_BATCH 32
+
+// Largest buffer size used by the memory function benchmarks, and how much
+// memory each of them moves in total.
+#define BENCH_STRING_MAX (1024*1024)
+#define BENCH_STRING_TOTAL (64*1024*1024)
+
+#ifdef CONFIG_MM_DEBUG
+#define BENCH_MODE "MM_DEBUG"
+#else
+#define BENCH_MODE "production"
+#endif
+
+// Time BENCH_ROUNDS batches of kmalloc() followed by kfree() of the same size.
+static void bench_kmalloc(size_t size) {
+	void* ptrs[BENCH_BATCH];
+	uint64_t start, end;
+
+	start = arch_timestamp();
+
+	for (int round = 0; round < BENCH_ROUNDS; round++) {
+		for (int i = 0; i < BENCH_BATCH; i++)
+			ptrs[i] = kmalloc(size);
+		for (int i = 0; i < BENCH_BATCH; i++)
+			kfree(ptrs[i]);
+	}
+
+	end = arch_timestamp();
+
+	debug_log(LOGLEVEL_INFO, "bench: kmalloc+kfree %zu bytes: %llu ticks/op\n", size,
+		  (end - start) / (BENCH_ROUNDS * BENCH_BATCH));
+}
+
+// Same as above, for the page allocator.
+static void bench_pmm(int pages) {
+	void* ptrs[BENCH_BATCH];
+	uint64_t start, end;
+
+	start = arch_timestamp();
+
+	for (int round = 0; round < BENCH_ROUNDS; round++) {
+		for (int i = 0; i < BENCH_BATCH; i++)
+			ptrs[i] = pmm_alloc(pages);
+		for (int i = 0; i < BENCH_BATCH; i++) {
+			if (ptrs[i])
+				pmm_free(ptrs[i], pages);
+		}
+	}
+
+	end = arch_timestamp();
+
+	debug_log(LOGLEVEL_INFO, "bench: pmm_alloc+pmm_free %d page(s): %llu ticks/op\n", pages,
+		  (end - start) / (BENCH_ROUNDS * BENCH_BATCH));
+}
+
+// Time memcpy(), memmove() and memset() on power of two buffer sizes from 8
+// bytes up to and including BENCH_STRING_MAX bytes.
+static void bench_string(void) {
+	int pages = BENCH_STRING_MAX / PAGE_SIZE;
+	uint8_t* src = (uint8_t*)((uint64_t)pmm_alloc(pages) + boot_proto_hhdm_offset());
+	uint8_t* dest = (uint8_t*)((uint64_t)pmm_alloc(pages) + boot_proto_hhdm_offset());
+	uint64_t copy, move, set;
+
+	for (size_t size = 8; size <= BENCH_STRING_MAX; size *= 2) {
+		uint64_t count = BENCH_STRING_TOTAL / size;
+		uint64_t start;
+
+		start = arch_timestamp();
+		for (uint64_t i = 0; i < count; i++)
+			memcpy(dest, src, size);
+		copy = arch_timestamp() - start;
+
+		// Overlapping, so that the backward path is used.
+		start = arch_timestamp();
+		for (uint64_t i = 0; i < count; i++)
+			memmove(dest + 8, dest, size - 8);
+		move = arch_timestamp() - start;
+
+		start = arch_timestamp();
+		for (uint64_t i = 0; i < count; i++)
+			memset(dest, (int)i, size);
+		set = arch_timestamp() - start;
+
+		// Bytes per 1000 ticks keeps the numbers readable for both tiny and
+		// huge buffers.
+		debug_log(LOGLEVEL_INFO, "bench: %zu bytes: memcpy %llu, memmove %llu, memset %llu bytes/kilotick\n", size,
+			  (uint64_t)BENCH_STRING_TOTAL * 1000 / (copy ? copy : 1),
+			  (uint64_t)BENCH_STRING_TOTAL * 1000 / (move ? move : 1),
+			  (uint64_t)BENCH_STRING_TOTAL * 1000 / (set ? set : 1));
+	}
+
+	pmm_free((void*)((uint64_t)src - boot_proto_hhdm_offset()), pages);
+	pmm_free((void*)((uint64_t)dest - boot_proto_hhdm_offset()), pages);
+}
+
+void bench_run(void) {
+	static const size_t sizes[] = { 32, 256, 1024, 4096, 16384 };
+
+	debug_log(LOGLEVEL_INFO, "bench: running memory benchmarks (%s build)\n", BENCH_MODE);
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		bench_kmalloc(sizes[i]);
+
+	bench_pmm(1);
+	bench_pmm(16);
+
+	debug_log(LOGLEVEL_INFO, "bench: running memory function benchmarks\n");
+
+	bench_string();
+}
+
+#endif // CONFIG_BENCH
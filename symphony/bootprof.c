@@ -0,0 +1,132 @@
+/*
+ * File: bootprof.c
+ * 
+ * Authos(s): Popa Vlad (Garnek0)
+ *
+ * Copyright: BSD-2-Clause
+ *
+ * Description:
+ * Boot phase profiler. Records arch_timestamp() at the start and end of every
+ * init phase and reports how long each of them took.
+ */
+
+#ifdef CONFIG_BOOTPROF
+
+#include <symphony/bootprof.h>
+#include <symphony/debug.h>
+#include <symphony/arch/arch.h>
+
+struct bootprof_phase {
+	const char* name;
+	int depth;
+	uint64_t start;
+	uint64_t end;
+};
+
+static struct bootprof_phase phases[BOOTPROF_MAX_PHASES];
+static int phaseCount;
+
+// Indices of the phases currently running, -1 for phases that did not fit.
+static int running[BOOTPROF_MAX_DEPTH];
+static int depth;
+
+// Phases which did not fit in phases[] or exceeded BOOTPROF_MAX_DEPTH.
+static int phasesDropped;
+
+void bootprof_begin(const char* name) {
+	uint64_t now = arch_timestamp();
+
+	if (depth == BOOTPROF_MAX_DEPTH) {
+		phasesDropped++;
+		return;
+	}
+
+	if (phaseCount == BOOTPROF_MAX_PHASES) {
+		phasesDropped++;
+		running[depth++] = -1;
+		return;
+	}
+
+	phases[phaseCount] = (struct bootprof_phase){
+		.name = name,
+		.depth = depth,
+		.start = now
+	};
+
+	running[depth++] = phaseCount++;
+}
+
+void bootprof_end(void) {
+	uint64_t now = arch_timestamp();
+
+	if (depth == 0)
+		return;
+
+	int index = running[--depth];
+
+	if (index >= 0)
+		phases[index].end = now;
+}
+
+// Convert counter ticks to microseconds, or leave them be if the counter
+// frequency is unknown.
+static uint64_t bootprof_us(uint64_t ticks, uint64_t frequency) {
+	if (!frequency)
+		return ticks;
+
+	// Split up so ticks * 1000000 does not overflow.
+	return (ticks / frequency) * 1000000 + (ticks % frequency) * 1000000 / frequency;
+}
+
+// Indentation of sub-steps in the summary table. Points into a string
+// literal, so binary logs can still be decoded.
+static const char* bootprof_indent(int level) {
+	static const char spaces[] = "                ";
+
+	if (level * 2 > (int)sizeof(spaces) - 1)
+		level = (sizeof(spaces) - 1) / 2;
+
+	return &spaces[sizeof(spaces) - 1 - level * 2];
+}
+
+void bootprof_report(void) {
+	uint64_t frequency;
+	uint64_t base, total;
+	const char* unit;
+
+	while (depth)
+		bootprof_end();
+
+	if (!phaseCount)
+		return;
+
+	// Calibrated (if needed) by arch_init_very_early(), before anything was timed.
+	frequency = arch_timestamp_frequency();
+	unit = frequency ? "us" : "ticks";
+
+	base = phases[0].start;
+	total = phases[0].end - base;
+
+	debug_log(LOGLEVEL_INFO, "bootprof: counter at boot start: %llu %s, counter frequency: %llu Hz\n",
+		  bootprof_us(base, frequency), unit, frequency);
+
+	for (int i = 0; i < phaseCount; i++) {
+		uint64_t duration = phases[i].end - phases[i].start;
+
+		debug_log(LOGLEVEL_INFO, "bootprof: %10llu %s %3llu%%  %s%s\n", bootprof_us(duration, frequency), unit,
+			  total ? duration * 100 / total : 0, bootprof_indent(phases[i].depth), phases[i].name);
+	}
+
+	if (phasesDropped)
+		debug_log(LOGLEVEL_WARN, "bootprof: %d phases not recorded\n", phasesDropped);
+
+	debug_printf("bootprof,phase,depth,start_%s,duration_%s\n", unit, unit);
+
+	for (int i = 0; i < phaseCount; i++) {
+		debug_printf("bootprof,%s,%d,%llu,%llu\n", phases[i].name, phases[i].depth,
+			     bootprof_us(phases[i].start - base, frequency),
+			     bootprof_us(phases[i].end - phases[i].start, frequency));
+	}
+}
+
+#endif
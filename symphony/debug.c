@@ -13,6 +13,7 @@
 #include <symphony/string.h>
 #include <symphony/arch/arch.h>
 #include <symphony/serial.h>
+#include <symphony/log.h>
 
 #define LEFT_ALIGN 1
 #define PLUS_FOR_POSITIVE (1 << 1)
@@ -34,135 +35,161 @@
 
 #define IS_DIGIT(c) ((c) >= '0' && (c) <= '9') 
 
-char debug_putchar(char chr) {
+// Output buffer of the formatter. Once it is full, it is either appended to
+// the kernel log and reused (if flush is set), or the rest of the output is
+// dropped. Either way, total counts every character produced.
+struct debug_buffer {
+	char* data;
+	size_t size;
+	size_t pos;
+	size_t total;
+	bool flush;
+
+	// Loglevel of the next log record.
+	int loglevel;
+};
+
+uint8_t debugLogLevels[LOG_SUBSYS_COUNT] = {
+	[LOG_SUBSYS_KERNEL] = LOGLEVEL_KERNEL,
+	[LOG_SUBSYS_MM] = LOGLEVEL_MM,
+	[LOG_SUBSYS_ARCH] = LOGLEVEL_ARCH
+};
+
+void debug_log_set_level(int subsystem, int loglevel) {
+	if (subsystem < 0 || subsystem >= LOG_SUBSYS_COUNT)
+		return;
+
+	// Fatal logs can not be turned off.
+	if (loglevel > LOGLEVEL_FATAL)
+		loglevel = LOGLEVEL_FATAL;
+
+	__atomic_store_n(&debugLogLevels[subsystem], loglevel, __ATOMIC_RELAXED);
+}
+
+void debug_write(const char* str, size_t len) {
 #ifdef __x86_64__
 	// 0xE9 Port hack for x86 QEMU/Bochs.
-	arch_outb(0xE9, chr);
+	for (size_t i = 0; i < len; i++)
+		arch_outb(0xE9, str[i]);
+#endif
+	serial_write(str, len);
+}
+
+#ifdef CONFIG_BINLOG
+
+void debug_write_binary(const void* data, size_t len) {
+#ifdef __x86_64__
+	// The serial port is left out, it does newline translation.
+	for (size_t i = 0; i < len; i++)
+		arch_outb(0xE9, ((const uint8_t*)data)[i]);
+#else
+	(void)data;
+	(void)len;
+#endif
+}
+
 #endif
-	serial_char(chr);
+
+char debug_putchar(char chr) {
+	log_write(LOGLEVEL_NONE, &chr, 1);
 
 	return chr;
 }
 
 int debug_print(const char* str) {
-	for (size_t i = 0; i < strlen(str); i++)
-		debug_putchar(str[i]);
+	size_t len = strlen(str);
+
+	// Split it up like debug_vlog() would.
+	for (size_t i = 0; i < len; i += LOG_LINE_MAX)
+		log_write(LOGLEVEL_NONE, str + i, len - i);
+
+	return len;
+}
+
+static inline void debug_buffer_putc(struct debug_buffer* out, char chr) {
+	out->total++;
+
+	if (out->pos == out->size) {
+		if (!out->flush)
+			return;
+
+		// The rest of the text continues the same message.
+		log_write(out->loglevel, out->data, out->pos);
+		out->loglevel = LOGLEVEL_NONE;
+		out->pos = 0;
+	}
+
+	out->data[out->pos++] = chr;
+}
+
+static void debug_buffer_puts(struct debug_buffer* out, const char* str) {
+	while (*str)
+		debug_buffer_putc(out, *str++);
+}
 
-	return strlen(str);
+static void debug_buffer_pad(struct debug_buffer* out, char chr, int count) {
+	for (int i = 0; i < count; i++)
+		debug_buffer_putc(out, chr);
 }
 
-// Internal integer formatting function for debug_vprintf().
-static int debug_print_int(uintmax_t n, int flags, int width, int base, bool sign, bool upper) {
-	int chars = 0;
+// Internal integer formatting function for debug_format().
+static void debug_format_int(struct debug_buffer* out, uintmax_t n, int flags, int width, int base, bool sign, bool upper) {
 	bool negative = (((intmax_t)n < 0) && sign) ? true : false;
 
-	const char digitsLower[] = "0123456789abcdef";
-	const char digitsUpper[] = "0123456789ABCDEF";
+	const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
 
-	uintmax_t revn = 0;	
+	char buf[64];
 	int dcount = 0;
 
 	if (negative)
 		n = (uintmax_t)-((intmax_t)n);
 
 	if (base > 16)
-		return 0;
+		return;
 
+	// Digits come out least significant first.
 	do {
-		dcount++;
-		revn *= base;
-		revn += n%base;
+		buf[dcount++] = digits[n % base];
 		n /= base;
 	} while (n != 0);
 
-	if (negative) {
-		debug_putchar('-');
-		chars++;
-	} else {
-		if (flags & PLUS_FOR_POSITIVE) {
-			debug_putchar('+');
-			chars++;
-		} else if (flags & SPACE_FOR_POSITIVE) {
-			debug_putchar(' ');
-			chars++;
-		}
-	}
+	if (negative)
+		debug_buffer_putc(out, '-');
+	else if (flags & PLUS_FOR_POSITIVE)
+		debug_buffer_putc(out, '+');
+	else if (flags & SPACE_FOR_POSITIVE)
+		debug_buffer_putc(out, ' ');
 
 	if (base == 8 && (flags & SPECIAL_HASH)) {
-		debug_putchar('0');
+		debug_buffer_putc(out, '0');
 	} else if (base == 16 && (flags & SPECIAL_HASH)) {
-		debug_putchar('0');
-		if (upper)
-			debug_putchar('X');
-		else
-			debug_putchar('x');
+		debug_buffer_putc(out, '0');
+		debug_buffer_putc(out, upper ? 'X' : 'x');
 	}
 
-	if ((width - dcount) > 0 && !(flags & LEFT_ALIGN)) {
-		if (flags & PREPEND_ZEROES) {
-			for (int i = 0; i < width - dcount; i++) {
-				debug_putchar('0');
-				chars++;
-			}
-		} else {
-			for (int i = 0; i < (width - dcount); i++) {
-				debug_putchar(' ');
-				chars++;
-			}
-		}
-	}
+	char padding = (flags & PREPEND_ZEROES) ? '0' : ' ';
 
-	for (int i = 0; i < dcount; i++) {
-		if (upper)
-			debug_putchar(digitsUpper[revn % base]);
-		else 
-			debug_putchar(digitsLower[revn % base]);
+	if (!(flags & LEFT_ALIGN))
+		debug_buffer_pad(out, padding, width - dcount);
 
-		revn /= base;
-		chars++;
-	}
+	for (int i = dcount - 1; i >= 0; i--)
+		debug_buffer_putc(out, buf[i]);
 
-	if ((width - dcount) > 0 && (flags & LEFT_ALIGN)) {
-		if (flags & PREPEND_ZEROES) {
-			for (int i = 0; i < width - dcount; i++) {
-				debug_putchar('0');
-				chars++;
-			}
-		} else {
-			for (int i = 0; i < width - dcount; i++) {
-				debug_putchar(' ');
-				chars++;
-			}
-		}
-	}
-
-	return chars;
+	if (flags & LEFT_ALIGN)
+		debug_buffer_pad(out, padding, width - dcount);
 }
 
-int debug_printf(const char* fmt, ...) {
-	va_list args;
-	va_start(args, fmt);
-	int chars;
-
-	chars = debug_vprintf(fmt, args);
-	va_end(args);
-
-	return chars;
-}
-
-int debug_vprintf(const char* fmt, va_list args) {
-	int chars = 0;
-
+// Format a string into a buffer, in a single pass over the format string.
+static void debug_format(struct debug_buffer* out, const char* fmt, va_list args) {
 	int flags, prevflags;
 	int width;
 	int length;
 
 	uintmax_t value;
 
-	for (size_t i = 0; i < strlen(fmt); i++) {
+	for (size_t i = 0; fmt[i] != '\0'; i++) {
 		if (fmt[i] != '%') {
-			debug_putchar(fmt[i]);
-			chars++;
+			debug_buffer_putc(out, fmt[i]);
 			continue;
 		}
 
@@ -296,73 +323,78 @@ int debug_vprintf(const char* fmt, va_list args) {
 		// Do the printing
 		switch (fmt[i]) {
 			case '%':
-				chars += debug_putchar('%');
+				debug_buffer_putc(out, '%');
 				break;
 			case 'd':
 			case 'i':
-				chars += debug_print_int((intmax_t)value, flags, width, 10, true, false);
+				debug_format_int(out, (intmax_t)value, flags, width, 10, true, false);
 				break;
 			case 'u':
-				chars += debug_print_int(value, flags, width, 10, false, false);
+				debug_format_int(out, value, flags, width, 10, false, false);
 				break;
 			case 'x':
-				chars += debug_print_int(value, flags, width, 16, false, false);
+				debug_format_int(out, value, flags, width, 16, false, false);
 				break;
 			case 'X':
-				chars += debug_print_int(value, flags, width, 16, false, true);
+				debug_format_int(out, value, flags, width, 16, false, true);
 				break;
 			case 'p':
-				chars += debug_print_int(value, flags, width, 16, false, true);
+				debug_format_int(out, value, flags, width, 16, false, true);
 				break;
 			case 'o':
-				chars += debug_print_int(value, flags, width, 8, false, false);
+				debug_format_int(out, value, flags, width, 8, false, false);
 				break;
 			case 's':
 				if(!value)
-					chars += debug_print("(null)");
+					debug_buffer_puts(out, "(null)");
 				else
-					chars += debug_print((const char*)value);
+					debug_buffer_puts(out, (const char*)value);
 				break;
 			case 'c':
-				chars += 1;
-				debug_putchar((char)value);
+				debug_buffer_putc(out, (char)value);
 				break;
 			default:	
 				break;
 		}
+
+		// A format string cut off in the middle of a conversion.
+		if (fmt[i] == '\0')
+			break;
 	}
+}
 
-	return chars;
+int debug_vsnprintf(char* buf, size_t size, const char* fmt, va_list args) {
+	// Leave room for the null terminator.
+	struct debug_buffer out = {
+		.data = buf,
+		.size = size ? size - 1 : 0,
+		.flush = false
+	};
+
+	debug_format(&out, fmt, args);
+
+	if (size)
+		buf[out.pos] = '\0';
+
+	return out.total;
 }
 
-int debug_log(int loglevel, const char* fmt, ...) {
+int debug_snprintf(char* buf, size_t size, const char* fmt, ...) {
 	va_list args;
 	va_start(args, fmt);
 	int chars;
 
-	switch (loglevel) {
-		case LOGLEVEL_TRACE:
-			debug_print("[ TRACE ] ");
-			break;
-		case LOGLEVEL_DEBUG:
-			debug_print("[ DEBUG ] ");
-			break;
-		case LOGLEVEL_INFO:
-			debug_print("[ INFO  ] ");
-			break;
-		case LOGLEVEL_WARN:
-			debug_print("[ WARN  ] ");
-			break;
-		case LOGLEVEL_ERROR:
-			debug_print("[ ERROR ] ");
-			break;
-		case LOGLEVEL_FATAL:
-			debug_print("[ FATAL ] ");
-			break;
-		default:
-			debug_print("[ UNK ] ");
-			break;
-	}
+	chars = debug_vsnprintf(buf, size, fmt, args);
+	va_end(args);
+
+	return chars;
+}
+
+// Parenthesized, since it is a macro with CONFIG_BINLOG.
+int (debug_printf)(const char* fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	int chars;
 
 	chars = debug_vprintf(fmt, args);
 	va_end(args);
@@ -370,15 +402,52 @@ int debug_log(int loglevel, const char* fmt, ...) {
 	return chars;
 }
 
+// Format a string and append it to the kernel log, in as few records as
+// possible.
+static int debug_vlog(int loglevel, const char* fmt, va_list args) {
+	char buf[LOG_LINE_MAX];
+	struct debug_buffer out = {
+		.data = buf,
+		.size = sizeof(buf),
+		.flush = true,
+		.loglevel = loglevel
+	};
+
+	debug_format(&out, fmt, args);
+
+	log_write(out.loglevel, buf, out.pos);
+
+	return out.total;
+}
+
+int debug_vprintf(const char* fmt, va_list args) {
+	return debug_vlog(LOGLEVEL_NONE, fmt, args);
+}
+
+int __debug_log(int loglevel, const char* fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	int chars;
+
+	chars = debug_vlog(loglevel, fmt, args);
+	va_end(args);
+
+	return chars;
+}
+
 void debug_panic(const char* fmt, ...) {
 	va_list args;
 	va_start(args, fmt);
 
-	debug_log(LOGLEVEL_FATAL, "Kernel Panic! ");
+	__debug_log(LOGLEVEL_FATAL, "Kernel Panic! ");
 	debug_vprintf(fmt, args);
 
 	va_end(args);
 
+	// Nothing is going to flush the log after this.
+	serial_sync();
+	log_flush(true);
+
 	arch_halt();
 
 	__builtin_unreachable();
@@ -386,7 +455,9 @@ void debug_panic(const char* fmt, ...) {
 
 void __debug_assert(int cond, const char* message, const char* func, const char* file, int line) {
 	if (!cond) {
-		debug_log(LOGLEVEL_FATAL, "Assertion failed in %s (%s:%d): %s", func, file, line, message);
+		__debug_log(LOGLEVEL_FATAL, "Assertion failed in %s (%s:%d): %s", func, file, line, message);
+		serial_sync();
+		log_flush(true);
 		arch_halt();
 	}
 }
@@ -16,19 +16,42 @@
 #include <symphony/arch/arch.h>
 #include <symphony/mm.h>
 #include <symphony/boot_proto.h>
+#include <symphony/bench.h>
+#include <symphony/log.h>
+#include <symphony/bootprof.h>
+
+// Run background work for as long as there is any, then halt. There is no
+// scheduler yet, so this only runs once, after boot.
+static void kernel_idle(void) {
+	kheap_trim(KHEAP_TRIM_WATERMARK);
+
+	while (pmm_zero_idle())
+		continue;
+
+	log_flush(false);
+
+	arch_halt();
+}
 
 // Kernel entry point
 void _start(void) {
+	// Not timed, it may spend a while calibrating the timestamp counter.
 	if (arch_init_very_early(0) != 0)
 		arch_halt();
 
+	bootprof_begin("boot");
+
+	bootprof_begin("serial_init");
 	serial_init();
+	bootprof_end();
 
 	debug_printf("Symphony "KERNEL_VER_STRING" is starting...\n");	
 
 	if (!boot_proto_bl_supported())
 		debug_panic("Bootloader not supported!\n");
 
+	bootprof_begin("bootloader info");
+
 	debug_log(LOGLEVEL_INFO, "Fetching Limine-compliant bootloader info...\n");
 	debug_log(LOGLEVEL_INFO, "Bootloader name: %s\n", boot_proto_bl_name());
 	debug_log(LOGLEVEL_INFO, "Bootloader version: %s\n", boot_proto_bl_version());
@@ -63,22 +86,55 @@ void _start(void) {
 			   boot_proto_memmap_type_to_str(entry.type));
 	}
 
+	bootprof_end();
+
+	bootprof_begin("pmm_init");
 	if (pmm_init() != 0)
 		debug_panic("PMM initialization failed!\n");
+	bootprof_end();
 
+	bootprof_begin("arch_init_early");
 	if (arch_init_early(0) != 0)
 		debug_panic("Early arch initialization failed!\n");
+	bootprof_end();
 
+	bootprof_begin("vmm_init");
 	if (vmm_init() != 0)
 		debug_panic("VMM initialization failed!\n");
+	bootprof_end();
+
+	bootprof_begin("slab_init");
+	if (slab_init() != 0)
+		debug_panic("Slab allocator initialization failed!\n");
+	bootprof_end();
 
+	bootprof_begin("kheap_init");
 	if(kheap_init() != 0)
 		debug_panic("Kernel heap initialization failed\n");
+	bootprof_end();
 
+	bootprof_begin("arch_init_late");
 	if (arch_init_late(0) != 0)
 		debug_panic("Late arch initialization failed!\n");
+	bootprof_end();
 
 	debug_log(LOGLEVEL_INFO, "Init done\n");
 
-	arch_halt();
+	bootprof_report();
+
+	// From now on, logging does not wait for the output devices. The log is
+	// written out whenever the CPU goes idle.
+	log_set_deferred(true);
+
+#ifdef CONFIG_MM_DEBUG
+	pmm_dump_stats();
+	kmem_cache_dump_stats();
+	kheap_dump_stats();
+#endif
+
+#ifdef CONFIG_BENCH
+	bench_run();
+#endif
+
+	kernel_idle();
 }
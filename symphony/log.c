@@ -0,0 +1,320 @@
+/*
+ * File: log.c
+ * 
+ * Authos(s): Popa Vlad (Garnek0)
+ *
+ * Copyright: BSD-2-Clause
+ *
+ * Description:
+ * Kernel log buffer. Every CPU appends log records to its own lock-free ring
+ * buffer, which are then written out to the output devices by log_flush(),
+ * merged back in order by their sequence numbers.
+ *
+ * With CONFIG_BINLOG, debug_log() call sites store a format ID and their raw
+ * arguments instead of text, and the log is written out as a stream of binary
+ * frames, to be decoded on the host by scripts/binlog-decode.
+ */
+
+#include <symphony/log.h>
+#include <symphony/debug.h>
+#include <symphony/string.h>
+#include <symphony/spinlock.h>
+#include <symphony/serial.h>
+#include <symphony/arch/arch.h>
+
+// Record flags
+#define LOG_RECORD_COMMITTED 1
+#define LOG_RECORD_PAD (1 << 1)
+#define LOG_RECORD_BINARY (1 << 2)
+
+struct log_record {
+	uint64_t seq;
+	uint64_t timestamp;
+	uint16_t len;
+	uint8_t level;
+	// Written last, once the rest of the record is valid.
+	uint8_t flags;
+	uint32_t reserved;
+};
+
+// Records are 8 byte aligned and never wrap around the end of the ring. Any
+// space left at the end which is too small for a record is skipped, larger
+// gaps are filled with a padding record.
+//
+// head and tail only ever grow. The owning CPU (including interrupt handlers
+// running on it) reserves space by moving head forward, the flusher moves tail
+// forward once records have been written out. Consumed space is cleared, so
+// the flags of a record which is not committed yet always read as 0.
+struct log_ring {
+	uint8_t data[LOG_RING_SIZE] __attribute__((aligned(8)));
+	uint64_t head;
+	uint64_t tail;
+
+	uint64_t dropped;
+	uint64_t droppedReported;
+};
+
+static struct log_ring rings[MAX_CPUS];
+
+static uint64_t logSequence;
+static bool logDeferred;
+
+// Serializes flushers.
+static struct spinlock flushLock = SPINLOCK_INIT;
+
+static inline struct log_record* log_record_at(struct log_ring* ring, uint64_t pos) {
+	return (struct log_record*)&ring->data[pos % LOG_RING_SIZE];
+}
+
+static inline size_t log_record_size(size_t len) {
+	return (sizeof(struct log_record) + len + 7) & ~(size_t)7;
+}
+
+// Reserve space for a record of size bytes. Returns NULL if the ring is full.
+static struct log_record* log_reserve(struct log_ring* ring, size_t size) {
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	uint64_t start, left;
+
+	do {
+		left = LOG_RING_SIZE - head % LOG_RING_SIZE;
+		start = (left < size) ? head + left : head;
+
+		if (start + size - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > LOG_RING_SIZE)
+			return NULL;
+	} while (!__atomic_compare_exchange_n(&ring->head, &head, start + size, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+	if (start != head && left >= sizeof(struct log_record))
+		__atomic_store_n(&log_record_at(ring, head)->flags, LOG_RECORD_COMMITTED | LOG_RECORD_PAD, __ATOMIC_RELEASE);
+
+	return log_record_at(ring, start);
+}
+
+// Get the oldest record of a ring, skipping padding. Returns NULL if the ring
+// is empty or the oldest record is still being written. Flushers only.
+static struct log_record* log_peek(struct log_ring* ring) {
+	for (;;) {
+		uint64_t tail = ring->tail;
+
+		if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+			return NULL;
+
+		uint64_t left = LOG_RING_SIZE - tail % LOG_RING_SIZE;
+		struct log_record* record = log_record_at(ring, tail);
+
+		if (left >= sizeof(struct log_record)) {
+			uint8_t flags = __atomic_load_n(&record->flags, __ATOMIC_ACQUIRE);
+
+			if (!(flags & LOG_RECORD_COMMITTED))
+				return NULL;
+			if (!(flags & LOG_RECORD_PAD))
+				return record;
+
+			memset(record, 0, left);
+		}
+
+		__atomic_store_n(&ring->tail, tail + left, __ATOMIC_RELEASE);
+	}
+}
+
+// Drop the oldest record of a ring, returned by log_peek().
+static void log_consume(struct log_ring* ring, struct log_record* record) {
+	size_t size = log_record_size(record->len);
+
+	memset(record, 0, size);
+	__atomic_store_n(&ring->tail, ring->tail + size, __ATOMIC_RELEASE);
+}
+
+static const char* log_prefix(int loglevel) {
+	switch (loglevel) {
+		case LOGLEVEL_NONE:
+			return "";
+		case LOGLEVEL_TRACE:
+			return "[ TRACE ] ";
+		case LOGLEVEL_DEBUG:
+			return "[ DEBUG ] ";
+		case LOGLEVEL_INFO:
+			return "[ INFO  ] ";
+		case LOGLEVEL_WARN:
+			return "[ WARN  ] ";
+		case LOGLEVEL_ERROR:
+			return "[ ERROR ] ";
+		case LOGLEVEL_FATAL:
+			return "[ FATAL ] ";
+		default:
+			return "[ UNK ] ";
+	}
+}
+
+#ifndef CONFIG_BINLOG
+
+// Write out the timestamp and loglevel prefix of a record. Records without a
+// loglevel continue the previous line and get neither.
+static void log_write_prefix(int loglevel, uint64_t timestamp) {
+	const char* prefix = log_prefix(loglevel);
+	uint64_t frequency = arch_timestamp_frequency();
+	char buf[32];
+	int len;
+
+	if (loglevel == LOGLEVEL_NONE)
+		return;
+
+	// Raw ticks until the counter has been calibrated.
+	if (frequency) {
+		len = debug_snprintf(buf, sizeof(buf), "[%5llu.%06llu] ", timestamp / frequency,
+				     (timestamp % frequency) * 1000000 / frequency);
+	} else {
+		len = debug_snprintf(buf, sizeof(buf), "[%llu] ", timestamp);
+	}
+
+	debug_write(buf, len < (int)sizeof(buf) ? len : (int)sizeof(buf) - 1);
+	debug_write(prefix, strlen(prefix));
+}
+
+#endif
+
+// Append a record made of two chunks of data.
+static void log_append(int loglevel, uint8_t flags, const void* data, size_t len, const void* extra, size_t extraLen) {
+	struct log_ring* ring = &rings[arch_cpu_current()];
+
+	if (len + extraLen > LOG_LINE_MAX) {
+		extraLen = (extraLen > LOG_LINE_MAX) ? LOG_LINE_MAX : extraLen;
+		len = LOG_LINE_MAX - extraLen;
+	}
+
+	size_t size = log_record_size(len + extraLen);
+	struct log_record* record = log_reserve(ring, size);
+
+	// Make room and try again.
+	if (!record && log_flush(false))
+		record = log_reserve(ring, size);
+
+	if (!record) {
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	record->seq = __atomic_fetch_add(&logSequence, 1, __ATOMIC_RELAXED);
+	record->timestamp = arch_timestamp();
+	record->len = len + extraLen;
+	record->level = loglevel;
+	memcpy((void*)(record + 1), data, len);
+	memcpy((uint8_t*)(record + 1) + len, extra, extraLen);
+
+	__atomic_store_n(&record->flags, LOG_RECORD_COMMITTED | flags, __ATOMIC_RELEASE);
+
+	if (!logDeferred)
+		log_flush(false);
+}
+
+void log_write(int loglevel, const char* text, size_t len) {
+	if (!len)
+		return;
+
+	log_append(loglevel, 0, text, len, NULL, 0);
+}
+
+#ifdef CONFIG_BINLOG
+
+void log_write_binary(int loglevel, const char* format, const uint64_t* args, size_t nargs) {
+	struct log_binary binary = {
+		.format = format - __log_fmt_start,
+		.nargs = nargs
+	};
+
+	log_append(loglevel, LOG_RECORD_BINARY, &binary, sizeof(binary), args, nargs * sizeof(uint64_t));
+}
+
+// Write out a record as a binary frame.
+static void log_emit(int loglevel, int type, uint64_t seq, uint64_t timestamp, const void* data, size_t len) {
+	struct log_frame frame = {
+		.magic = LOG_FRAME_MAGIC,
+		.len = len,
+		.level = loglevel,
+		.type = type,
+		.seq = seq,
+		.timestamp = timestamp
+	};
+
+	debug_write_binary(&frame, sizeof(frame));
+	debug_write_binary(data, len);
+
+	// Text records (panics, failed assertions, dropped record reports) also go
+	// to the serial port as plain text, so they can be read without the decoder.
+	if (type == LOG_FRAME_TEXT) {
+		const char* prefix = log_prefix(loglevel);
+
+		serial_write(prefix, strlen(prefix));
+		serial_write(data, len);
+	}
+}
+
+#endif
+
+bool log_flush(bool force) {
+	bool flushed = false;
+
+	// Whoever holds the lock during a panic is not going to release it.
+	if (!spinlock_try_acquire(&flushLock) && !force)
+		return false;
+
+	for (;;) {
+		struct log_ring* ring = NULL;
+		struct log_record* record = NULL;
+
+		for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+			struct log_record* r = log_peek(&rings[cpu]);
+
+			if (r && (!record || r->seq < record->seq)) {
+				ring = &rings[cpu];
+				record = r;
+			}
+		}
+
+		if (!record)
+			break;
+
+#ifdef CONFIG_BINLOG
+		log_emit(record->level, (record->flags & LOG_RECORD_BINARY) ? LOG_FRAME_BINARY : LOG_FRAME_TEXT,
+			 record->seq, record->timestamp, record + 1, record->len);
+#else
+		log_write_prefix(record->level, record->timestamp);
+		debug_write((const char*)(record + 1), record->len);
+#endif
+
+		log_consume(ring, record);
+		flushed = true;
+	}
+
+	for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		uint64_t dropped = __atomic_load_n(&rings[cpu].dropped, __ATOMIC_RELAXED);
+		char buf[64];
+
+		if (dropped == rings[cpu].droppedReported)
+			continue;
+
+#ifdef CONFIG_BINLOG
+		int len = debug_snprintf(buf, sizeof(buf), "%llu log records dropped on CPU %d\n",
+					 dropped - rings[cpu].droppedReported, cpu);
+		log_emit(LOGLEVEL_WARN, LOG_FRAME_TEXT, 0, arch_timestamp(), buf,
+			 len < (int)sizeof(buf) ? len : (int)sizeof(buf) - 1);
+#else
+		int len = debug_snprintf(buf, sizeof(buf), "%llu log records dropped on CPU %d\n",
+					 dropped - rings[cpu].droppedReported, cpu);
+		log_write_prefix(LOGLEVEL_WARN, arch_timestamp());
+		debug_write(buf, len < (int)sizeof(buf) ? len : (int)sizeof(buf) - 1);
+#endif
+
+		rings[cpu].droppedReported = dropped;
+	}
+
+	spinlock_release(&flushLock);
+
+	return flushed;
+}
+
+void log_set_deferred(bool defer) {
+	logDeferred = defer;
+
+	if (!defer)
+		log_flush(false);
+}
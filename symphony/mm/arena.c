@@ -0,0 +1,114 @@
+/*
+ * File: mm/arena.c
+ * 
+ * Authos(s): Popa Vlad (Garnek0)
+ *
+ * Copyright: BSD-2-Clause
+ *
+ * Description:
+ * Arena (bump pointer) allocator.
+ */
+
+#define LOG_SUBSYSTEM LOG_SUBSYS_MM
+
+#include <symphony/mm.h>
+#include <symphony/boot_proto.h>
+#include <symphony/debug.h>
+
+#define ARENA_DEFAULT_ALIGNMENT 16
+
+struct arena_chunk {
+	struct arena_chunk* prev;
+	size_t pages;
+};
+
+// Free all chunks newer than the given one.
+static void arena_free_chunks(struct arena* arena, struct arena_chunk* keep) {
+	while (arena->chunk != keep) {
+		struct arena_chunk* chunk = arena->chunk;
+		arena->chunk = chunk->prev;
+
+		pmm_free((void*)((uint64_t)chunk - boot_proto_hhdm_offset()), chunk->pages);
+	}
+}
+
+// Start allocating from a new chunk with room for at least size bytes.
+static void arena_new_chunk(struct arena* arena, size_t size, size_t alignment) {
+	size_t needed = ALIGN_UP(sizeof(struct arena_chunk), alignment) + size;
+	size_t pages = ALIGN_UP(needed, PAGE_SIZE) / PAGE_SIZE;
+
+	if (pages < arena->chunkPages)
+		pages = arena->chunkPages;
+
+	struct arena_chunk* chunk = (struct arena_chunk*)((uint64_t)pmm_alloc(pages) + boot_proto_hhdm_offset());
+
+	chunk->prev = arena->chunk;
+	chunk->pages = pages;
+
+	arena->chunk = chunk;
+	arena->pos = (uint64_t)chunk + sizeof(struct arena_chunk);
+	arena->end = (uint64_t)chunk + pages * PAGE_SIZE;
+}
+
+void arena_init(struct arena* arena, size_t chunkPages) {
+	arena->chunk = NULL;
+	arena->pos = arena->end = 0;
+	arena->chunkPages = chunkPages ? chunkPages : ARENA_CHUNK_PAGES;
+}
+
+void* arena_alloc(struct arena* arena, size_t size, size_t alignment) {
+	if (!alignment)
+		alignment = ARENA_DEFAULT_ALIGNMENT;
+
+	assert(!(alignment & (alignment - 1)), "Arena allocation alignment is not a power of two!\n");
+
+	uint64_t addr = (arena->pos + alignment - 1) & ~(uint64_t)(alignment - 1);
+
+	if (!arena->chunk || addr + size > arena->end) {
+		arena_new_chunk(arena, size, alignment);
+		addr = (arena->pos + alignment - 1) & ~(uint64_t)(alignment - 1);
+	}
+
+	arena->pos = addr + size;
+
+	return (void*)addr;
+}
+
+void arena_reset(struct arena* arena) {
+	if (!arena->chunk)
+		return;
+
+	struct arena_chunk* first = arena->chunk;
+	while (first->prev)
+		first = first->prev;
+
+	arena_free_chunks(arena, first);
+
+	arena->pos = (uint64_t)first + sizeof(struct arena_chunk);
+	arena->end = (uint64_t)first + first->pages * PAGE_SIZE;
+}
+
+void arena_destroy(struct arena* arena) {
+	arena_free_chunks(arena, NULL);
+
+	arena->pos = arena->end = 0;
+}
+
+struct arena_scope arena_scope_begin(struct arena* arena) {
+	struct arena_scope scope = {
+		.arena = arena,
+		.chunk = arena->chunk,
+		.pos = arena->pos
+	};
+
+	return scope;
+}
+
+void arena_scope_end(struct arena_scope* scope) {
+	struct arena* arena = scope->arena;
+
+	arena_free_chunks(arena, scope->chunk);
+
+	arena->pos = scope->pos;
+	arena->end = scope->chunk ? (uint64_t)scope->chunk + scope->chunk->pages * PAGE_SIZE : 0;
+}
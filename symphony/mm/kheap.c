@@ -6,108 +6,621 @@
  * Copyright: BSD-2-Clause
  *
  * Description:
- * Kernel Heap Implementation.
+ * Kernel Heap Implementation. Free blocks are kept in segregated free lists
+ * (two-level, TLSF-style) and every free block ends with a footer pointing
+ * back to its header, so both allocation and deallocation take constant time.
  */
 
+#define LOG_SUBSYSTEM LOG_SUBSYS_MM
+
 #include <symphony/mm.h>
 #include <symphony/boot_proto.h>
 #include <symphony/string.h>
+#include <symphony/spinlock.h>
 #include <symphony/debug.h>
 
+// Block flags
+#define KHEAP_BLOCK_FREE 1
+#define KHEAP_BLOCK_PREV_FREE (1 << 1)
+#define KHEAP_BLOCK_FIRST (1 << 2)
+#define KHEAP_BLOCK_QUARANTINE (1 << 3)
+
+#define KHEAP_BLOCK_MAGIC 0x4b484550
+
+// Each first-level size class (a power of two) is split into this many
+// second-level classes.
+#define KHEAP_SL_SHIFT 4
+#define KHEAP_SL_COUNT (1 << KHEAP_SL_SHIFT)
+
+// Blocks smaller than this all go in the first first-level class, which is
+// split linearly.
+#define KHEAP_FL_SHIFT (KHEAP_SL_SHIFT + 4)
+#define KHEAP_SMALL_SIZE (1 << KHEAP_FL_SHIFT)
+
+#define KHEAP_FL_COUNT (64 - KHEAP_FL_SHIFT + 1)
+
 struct kheap_block_header {
 	size_t size;
-	bool free;
-	struct kheap_block_header* next;
-	struct kheap_block_header* prev;
+	uint32_t flags;
+	uint32_t magic;
+
+#ifdef CONFIG_MM_DEBUG
+	// Size passed to kmalloc(), the code which called it and a redzone right
+	// before the data.
+	size_t requested;
+	void* caller;
+	uint64_t redzone[2];
+#endif
+
+	// Only valid while the block is free.
+	struct kheap_block_header* nextFree;
+	struct kheap_block_header* prevFree;
+};
+
+// Size of the part of the header which stays in use while the block is
+// allocated.
+#define KHEAP_HEADER_SIZE offsetof(struct kheap_block_header, nextFree)
+
+// Smallest usable block size. Free blocks need room for the free list
+// pointers and the footer.
+#define KHEAP_MIN_SIZE 32
+
+#ifdef CONFIG_MM_DEBUG
+// Minimum number of redzone bytes after the data of every block.
+#define KHEAP_REDZONE_SIZE 16
+#define KHEAP_REDZONE_BYTE 0xfd
+
+// Number of freed blocks held back before they can be reused.
+#define KHEAP_QUARANTINE_SIZE 256
+
+// Number of distinct kmalloc() callers which can be accounted for.
+#define KHEAP_CALLSITE_COUNT 256
+#endif
+
+// Number of buckets of the large allocation table.
+#define KHEAP_LARGE_BUCKETS 256
+
+// Allocation made directly from the PMM, bypassing the heap.
+struct kheap_large {
+	uint64_t addr;
+	size_t pages;
+	struct kheap_large* next;
+
+#ifdef CONFIG_MM_DEBUG
+	void* caller;
+#endif
 };
 
-static struct kheap_block_header* blockListStart;
-static struct kheap_block_header* blockListEnd;
+#ifdef CONFIG_MM_DEBUG
+// Memory allocated by a single kmalloc() caller.
+struct kheap_callsite {
+	void* caller;
+	uint64_t allocs;
+	uint64_t frees;
+	size_t inUse;
+};
+#endif
+
+static struct kheap_block_header* freeLists[KHEAP_FL_COUNT][KHEAP_SL_COUNT];
+static uint64_t flBitmap;
+static uint32_t slBitmap[KHEAP_FL_COUNT];
+
+static struct spinlock kheapLock = SPINLOCK_INIT;
+
+// Memory taken from the PMM, the part of it usable for allocations (everything
+// but the block headers) and the part of that which is allocated.
 static size_t kheapSize;
 static size_t kheapSizeUsable;
+static size_t kheapInUse;
+
+static size_t kheapPeakSize;
+static size_t kheapReleased;
+
+// Number of allocated and free blocks.
+static size_t kheapUsedBlocks;
+static size_t kheapFreeBlocks;
+
+// Per-CPU histogram of kmalloc() sizes, see kheap_histogram_bucket().
+static uint64_t sizeHistogram[MAX_CPUS][KHEAP_HISTOGRAM_BUCKETS];
+
+// Large allocations, hashed by address.
+static struct kheap_large* largeTable[KHEAP_LARGE_BUCKETS];
+static struct kmem_cache* largeCache;
+static struct spinlock largeLock = SPINLOCK_INIT;
+static size_t largeSize;
+
+#ifdef CONFIG_MM_DEBUG
+static struct kheap_block_header* quarantine[KHEAP_QUARANTINE_SIZE];
+static int quarantineNext;
+static struct spinlock quarantineLock = SPINLOCK_INIT;
+
+// Open addressed table of kmalloc() callers.
+static struct kheap_callsite callsites[KHEAP_CALLSITE_COUNT];
+static uint64_t callsitesDropped;
+static struct spinlock callsiteLock = SPINLOCK_INIT;
+#endif
+
+static inline void* kheap_block_data(struct kheap_block_header* bh) {
+	return (void*)((uint64_t)bh + KHEAP_HEADER_SIZE);
+}
+
+static inline struct kheap_block_header* kheap_block_from_data(void* ptr) {
+	return (struct kheap_block_header*)((uint64_t)ptr - KHEAP_HEADER_SIZE);
+}
+
+// Get the block right after a block in memory.
+static inline struct kheap_block_header* kheap_block_next(struct kheap_block_header* bh) {
+	return (struct kheap_block_header*)((uint64_t)bh + KHEAP_HEADER_SIZE + bh->size);
+}
+
+// Get the block right before a block in memory. Only valid if that block is
+// free (KHEAP_BLOCK_PREV_FREE is set).
+static inline struct kheap_block_header* kheap_block_prev(struct kheap_block_header* bh) {
+	return *(struct kheap_block_header**)((uint64_t)bh - sizeof(struct kheap_block_header*));
+}
+
+// Write the footer of a free block.
+static inline void kheap_block_set_footer(struct kheap_block_header* bh) {
+	*(struct kheap_block_header**)((uint64_t)kheap_block_next(bh) - sizeof(struct kheap_block_header*)) = bh;
+}
+
+// Get the free list a block of a given size belongs to.
+static void kheap_mapping(size_t size, int* fl, int* sl) {
+	if (size < KHEAP_SMALL_SIZE) {
+		*fl = 0;
+		*sl = size / (KHEAP_SMALL_SIZE / KHEAP_SL_COUNT);
+		return;
+	}
+
+	int msb = 63 - __builtin_clzll(size);
+
+	*sl = (size >> (msb - KHEAP_SL_SHIFT)) ^ KHEAP_SL_COUNT;
+	*fl = msb - KHEAP_FL_SHIFT + 1;
+}
+
+// Round a size up so that every block in its free list is large enough.
+static size_t kheap_search_size(size_t size) {
+	if (size < KHEAP_SMALL_SIZE)
+		return size;
+
+	int msb = 63 - __builtin_clzll(size);
+	size_t step = (size_t)1 << (msb - KHEAP_SL_SHIFT);
+
+	return ALIGN_UP(size, step);
+}
+
+static void kheap_list_insert(struct kheap_block_header* bh) {
+	int fl, sl;
+	kheap_mapping(bh->size, &fl, &sl);
+
+	bh->prevFree = NULL;
+	bh->nextFree = freeLists[fl][sl];
+	if (bh->nextFree)
+		bh->nextFree->prevFree = bh;
+	freeLists[fl][sl] = bh;
+
+	flBitmap |= (uint64_t)1 << fl;
+	slBitmap[fl] |= (uint32_t)1 << sl;
+
+	kheapFreeBlocks++;
+}
+
+static void kheap_list_remove(struct kheap_block_header* bh) {
+	int fl, sl;
+	kheap_mapping(bh->size, &fl, &sl);
+
+	if (bh->prevFree)
+		bh->prevFree->nextFree = bh->nextFree;
+	else
+		freeLists[fl][sl] = bh->nextFree;
+
+	if (bh->nextFree)
+		bh->nextFree->prevFree = bh->prevFree;
+
+	if (!freeLists[fl][sl]) {
+		slBitmap[fl] &= ~((uint32_t)1 << sl);
+		if (!slBitmap[fl])
+			flBitmap &= ~((uint64_t)1 << fl);
+	}
+
+	kheapFreeBlocks--;
+}
+
+// Find a free block at least size bytes large (size must come from
+// kheap_search_size()) and take it off its free list.
+static struct kheap_block_header* kheap_find(size_t size) {
+	int fl, sl;
+	kheap_mapping(size, &fl, &sl);
+
+	if (fl >= KHEAP_FL_COUNT)
+		return NULL;
+
+	uint32_t slMap = slBitmap[fl] & (~(uint32_t)0 << sl);
+
+	if (!slMap) {
+		uint64_t flMap = (fl + 1 < 64) ? flBitmap & (~(uint64_t)0 << (fl + 1)) : 0;
+		if (!flMap)
+			return NULL;
+
+		fl = __builtin_ctzll(flMap);
+		slMap = slBitmap[fl];
+	}
+
+	sl = __builtin_ctz(slMap);
+
+	struct kheap_block_header* bh = freeLists[fl][sl];
+	kheap_list_remove(bh);
+
+	return bh;
+}
+
+// Mark a block taken off a free list as used, splitting off whatever is left
+// after the first size bytes as a new free block.
+static void kheap_block_use(struct kheap_block_header* bh, size_t size) {
+	if (bh->size >= size + KHEAP_HEADER_SIZE + KHEAP_MIN_SIZE) {
+		struct kheap_block_header* rest = (struct kheap_block_header*)((uint64_t)bh + KHEAP_HEADER_SIZE + size);
+
+		rest->size = bh->size - size - KHEAP_HEADER_SIZE;
+		rest->flags = KHEAP_BLOCK_FREE;
+		rest->magic = KHEAP_BLOCK_MAGIC;
+		bh->size = size;
+
+		kheap_block_set_footer(rest);
+		kheap_list_insert(rest);
+
+		kheapSizeUsable -= KHEAP_HEADER_SIZE;
+	} else {
+		kheap_block_next(bh)->flags &= ~KHEAP_BLOCK_PREV_FREE;
+	}
+
+	bh->flags &= ~KHEAP_BLOCK_FREE;
+	kheapInUse += bh->size;
+	kheapUsedBlocks++;
+}
+
+// Add a memory region to the heap as one large free block followed by a
+// zero-sized, always used block marking the end of the region.
+static void kheap_add_region(void* base, size_t size) {
+	struct kheap_block_header* bh = (struct kheap_block_header*)base;
+
+	bh->size = size - 2*KHEAP_HEADER_SIZE;
+	bh->flags = KHEAP_BLOCK_FREE | KHEAP_BLOCK_FIRST;
+	bh->magic = KHEAP_BLOCK_MAGIC;
+
+	struct kheap_block_header* end = kheap_block_next(bh);
+	end->size = 0;
+	end->flags = KHEAP_BLOCK_PREV_FREE;
+	end->magic = KHEAP_BLOCK_MAGIC;
+
+	kheap_block_set_footer(bh);
+	kheap_list_insert(bh);
+
+	kheapSize += size;
+	kheapSizeUsable += bh->size;
+
+	if (kheapSize > kheapPeakSize)
+		kheapPeakSize = kheapSize;
+}
+
+// Give the whole pages inside a free block back to the PMM. Whatever is left
+// of the block before the released pages becomes a free block followed by a
+// new region end block (or just the end block), and whatever is left after
+// them becomes the first block of a new region.
+static size_t kheap_trim_block(struct kheap_block_header* bh) {
+	struct kheap_block_header* next = kheap_block_next(bh);
+	uint64_t start = (uint64_t)bh;
+	uint64_t end = (uint64_t)next;
+	uint64_t spanStart, spanEnd;
+
+	// Regions start on a page boundary.
+	if (bh->flags & KHEAP_BLOCK_FIRST) {
+		spanStart = start;
+	} else {
+		spanStart = (start + KHEAP_HEADER_SIZE + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+		if (spanStart - start > KHEAP_HEADER_SIZE && spanStart - start < 2*KHEAP_HEADER_SIZE + KHEAP_MIN_SIZE)
+			spanStart += PAGE_SIZE;
+	}
+
+	// So do they end on one.
+	if (next->size == 0) {
+		spanEnd = end + KHEAP_HEADER_SIZE;
+	} else {
+		spanEnd = end & ~(uint64_t)(PAGE_SIZE - 1);
+		if (end - spanEnd && end - spanEnd < KHEAP_HEADER_SIZE + KHEAP_MIN_SIZE)
+			spanEnd -= PAGE_SIZE;
+	}
+
+	if (spanEnd <= spanStart)
+		return 0;
+
+	kheap_list_remove(bh);
+	kheapSizeUsable -= bh->size;
+
+	if (spanStart != start) {
+		struct kheap_block_header* regionEnd = (struct kheap_block_header*)(spanStart - KHEAP_HEADER_SIZE);
+
+		if (regionEnd != bh) {
+			bh->size = (uint64_t)regionEnd - start - KHEAP_HEADER_SIZE;
+			kheap_block_set_footer(bh);
+			kheap_list_insert(bh);
+
+			kheapSizeUsable += bh->size;
+		}
+
+		regionEnd->size = 0;
+		regionEnd->flags = (regionEnd != bh) ? KHEAP_BLOCK_PREV_FREE : 0;
+		regionEnd->magic = KHEAP_BLOCK_MAGIC;
+	}
+
+	if (next->size != 0) {
+		if (spanEnd != end) {
+			struct kheap_block_header* first = (struct kheap_block_header*)spanEnd;
+
+			first->size = end - spanEnd - KHEAP_HEADER_SIZE;
+			first->flags = KHEAP_BLOCK_FREE | KHEAP_BLOCK_FIRST;
+			first->magic = KHEAP_BLOCK_MAGIC;
+			kheap_block_set_footer(first);
+			kheap_list_insert(first);
+
+			kheapSizeUsable += first->size;
+		} else {
+			next->flags = (next->flags & ~KHEAP_BLOCK_PREV_FREE) | KHEAP_BLOCK_FIRST;
+		}
+	}
+
+	pmm_free((void*)(spanStart - boot_proto_hhdm_offset()), (spanEnd - spanStart) / PAGE_SIZE);
+
+	kheapSize -= spanEnd - spanStart;
+	kheapReleased += spanEnd - spanStart;
+
+	return spanEnd - spanStart;
+}
 
 // Add more pages to the kernel heap
 static void kheap_extend(size_t size) {
-	size += sizeof(struct kheap_block_header);
+	size += 2*KHEAP_HEADER_SIZE;
 	if (size % PAGE_SIZE != 0) size = ALIGN_UP(size, PAGE_SIZE);
 
-	struct kheap_block_header* newbh = (struct kheap_block_header*)((uint64_t)pmm_alloc(size/PAGE_SIZE) + boot_proto_hhdm_offset());
-	memset(newbh, 0, size);
+	void* base = (void*)((uint64_t)pmm_alloc(size/PAGE_SIZE) + boot_proto_hhdm_offset());
+
+	kheap_add_region(base, size);
+}
 
-	newbh->size = size - sizeof(struct kheap_block_header);
-	newbh->free = true;
-	
-	newbh->prev = blockListEnd;
-	blockListEnd->next = newbh;
-	blockListEnd = newbh;
-	newbh->next = NULL;
+// Get the size histogram bucket of an allocation size. Bucket n counts sizes
+// up to 16 << n bytes, the last bucket counts everything larger.
+static inline int kheap_histogram_bucket(size_t size) {
+	if (size <= 16)
+		return 0;
 
-	kheapSize += size;
-	kheapSizeUsable += newbh->size;
+	int bucket = 64 - __builtin_clzll(size - 1) - 4;
+
+	return bucket < KHEAP_HISTOGRAM_BUCKETS ? bucket : KHEAP_HISTOGRAM_BUCKETS - 1;
+}
+
+static inline void kheap_histogram_add(size_t size) {
+	sizeHistogram[arch_cpu_current()][kheap_histogram_bucket(size)]++;
 }
 
-// Create a block with the specified usable size from another larger block.
-static void kheap_create_block(struct kheap_block_header* bh, size_t size) {
-	struct kheap_block_header* newbh = (struct kheap_block_header*)((uint64_t)bh + sizeof(struct kheap_block_header) + size);
-	memset(newbh, 0, sizeof(struct kheap_block_header));
+#ifdef CONFIG_MM_DEBUG
+// Account memory allocated (or freed, if alloc is false) by a caller.
+static void kheap_debug_account(void* caller, size_t size, bool alloc) {
+	size_t slot = (((uint64_t)caller * 0x9E3779B97F4A7C15) >> 32) % KHEAP_CALLSITE_COUNT;
 
-	// bh will have the usable size requested
-	// newbh will have whatever is left of the original block
+	spinlock_acquire(&callsiteLock);
 
-	newbh->size = bh->size - (size + sizeof(struct kheap_block_header));
-	bh->size = size;
+	for (int i = 0; i < KHEAP_CALLSITE_COUNT; i++) {
+		struct kheap_callsite* site = &callsites[(slot + i) % KHEAP_CALLSITE_COUNT];
 
-	newbh->next = bh->next;
-	bh->next = newbh;
-	newbh->prev = bh;
-	if (newbh->next)
-		newbh->next->prev = newbh;
+		if (site->caller && site->caller != caller)
+			continue;
+
+		site->caller = caller;
+
+		if (alloc) {
+			site->allocs++;
+			site->inUse += size;
+		} else {
+			site->frees++;
+			site->inUse -= size;
+		}
+
+		spinlock_release(&callsiteLock);
+		return;
+	}
 
-	newbh->free = true;
+	callsitesDropped++;
 
-	if (bh == blockListEnd)
-		blockListEnd = newbh;
+	spinlock_release(&callsiteLock);
+}
+
+// Fill the redzones of a newly allocated block.
+static void kheap_debug_alloc(struct kheap_block_header* bh, size_t requested, void* caller) {
+	bh->requested = requested;
+	bh->caller = caller;
+
+	kheap_debug_account(caller, requested, true);
+
+	memset(&bh->redzone, KHEAP_REDZONE_BYTE, sizeof(bh->redzone));
+	memset((void*)((uint64_t)kheap_block_data(bh) + requested), KHEAP_REDZONE_BYTE, bh->size - requested);
+}
+
+// Check whether a block has been written to past its boundaries.
+static void kheap_debug_check_redzones(struct kheap_block_header* bh) {
+	uint8_t* front = (uint8_t*)&bh->redzone;
+	uint8_t* back = (uint8_t*)kheap_block_data(bh) + bh->requested;
+
+	for (size_t i = 0; i < sizeof(bh->redzone); i++) {
+		if (front[i] != KHEAP_REDZONE_BYTE)
+			debug_panic("Kernel heap underflow before %p!\n", kheap_block_data(bh));
+	}
+
+	for (size_t i = 0; i < bh->size - bh->requested; i++) {
+		if (back[i] != KHEAP_REDZONE_BYTE)
+			debug_panic("Kernel heap overflow after %p (%lu bytes)!\n", kheap_block_data(bh), bh->requested);
+	}
+}
+
+// Put a freed (and poisoned) block in the quarantine. Returns the oldest block
+// in the quarantine once it is full, which can then be freed for real.
+static struct kheap_block_header* kheap_debug_quarantine(struct kheap_block_header* bh) {
+	bh->flags |= KHEAP_BLOCK_QUARANTINE;
+
+	spinlock_acquire(&quarantineLock);
+
+	struct kheap_block_header* old = quarantine[quarantineNext];
+	quarantine[quarantineNext] = bh;
+	quarantineNext = (quarantineNext + 1) % KHEAP_QUARANTINE_SIZE;
+
+	spinlock_release(&quarantineLock);
+
+	if (!old)
+		return NULL;
+
+	// The poison must still be intact.
+	uint64_t* data = (uint64_t*)kheap_block_data(old);
+	for (size_t i = 0; i < old->size / sizeof(uint64_t); i++) {
+		if (data[i] != ~(uint64_t)0)
+			debug_panic("Use after free of %p detected!\n", (void*)data);
+	}
+
+	old->flags &= ~KHEAP_BLOCK_QUARANTINE;
+
+	return old;
+}
+#endif
+
+static inline struct kheap_large** kheap_large_bucket(uint64_t addr) {
+	return &largeTable[((addr >> 12) * 0x9E3779B97F4A7C15) >> 56];
+}
+
+// Allocate whole pages straight from the PMM. All physical memory is mapped
+// in the HHDM already, so the HHDM address of the pages is used as is.
+static void* kheap_large_alloc(size_t size, size_t alignment, void* caller) {
+	size_t pages = size ? ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE : 1;
+	uint64_t addr = (uint64_t)pmm_alloc_aligned(pages, alignment, 0) + boot_proto_hhdm_offset();
+
+	struct kheap_large* large = (struct kheap_large*)kmem_cache_alloc(largeCache);
+	large->addr = addr;
+	large->pages = pages;
+
+#ifdef CONFIG_MM_DEBUG
+	large->caller = caller;
+	kheap_debug_account(caller, pages * PAGE_SIZE, true);
+#else
+	(void)caller;
+#endif
+
+	spinlock_acquire(&largeLock);
+
+	struct kheap_large** bucket = kheap_large_bucket(addr);
+	large->next = *bucket;
+	*bucket = large;
+
+	largeSize += pages * PAGE_SIZE;
+
+	spinlock_release(&largeLock);
+
+	return (void*)addr;
+}
+
+// Free a large allocation. Returns false if ptr is not one.
+static bool kheap_large_free(void* ptr) {
+	// Large allocations always start on a page boundary.
+	if ((uint64_t)ptr & (PAGE_SIZE - 1))
+		return false;
+
+	spinlock_acquire(&largeLock);
+
+	struct kheap_large** l = kheap_large_bucket((uint64_t)ptr);
+	while (*l && (*l)->addr != (uint64_t)ptr)
+		l = &(*l)->next;
+
+	struct kheap_large* large = *l;
+
+	if (large) {
+		*l = large->next;
+		largeSize -= large->pages * PAGE_SIZE;
+	}
+
+	spinlock_release(&largeLock);
+
+	if (!large)
+		return false;
+
+#ifdef CONFIG_MM_DEBUG
+	kheap_debug_account(large->caller, large->pages * PAGE_SIZE, false);
+#endif
+
+	pmm_free((void*)(large->addr - boot_proto_hhdm_offset()), large->pages);
+	kmem_cache_free(largeCache, large);
+
+	return true;
 }
 
 int kheap_init() {
-	blockListStart = blockListEnd = (struct kheap_block_header*)((uint64_t)pmm_alloc(KHEAP_INIT_PAGES) + boot_proto_hhdm_offset());
-	memset(blockListStart, 0, sizeof(struct kheap_block_header));
-	
-	blockListStart->size = (KHEAP_INIT_PAGES * PAGE_SIZE) - sizeof(struct kheap_block_header);
-	blockListStart->prev = NULL;
-	blockListStart->next = NULL;
-	blockListStart->free = true;
+	void* base = (void*)((uint64_t)pmm_alloc(KHEAP_INIT_PAGES) + boot_proto_hhdm_offset());
+
+	kheap_add_region(base, KHEAP_INIT_PAGES * PAGE_SIZE);
 
-	kheapSize = KHEAP_INIT_PAGES * PAGE_SIZE;
-	kheapSizeUsable = blockListStart->size;
+	largeCache = kmem_cache_create("kheap_large", sizeof(struct kheap_large), 0, NULL);
 
 	return 0;
 }
 
-void* kmalloc(size_t size) {
-	if (size % 10 != 0) size = ALIGN_UP(size, 0x10);
-	
-	for (struct kheap_block_header* bh = blockListStart; bh; bh = bh->next) {
-		if (!(bh->free) || bh->size < size)
-			continue;
+// Allocate memory on behalf of caller (only used for accounting).
+static void* kheap_alloc(size_t size, void* caller) {
+#ifndef CONFIG_MM_DEBUG
+	// Debug builds send small allocations through the heap too, so that they
+	// get redzones.
+	if (size <= SLAB_KMALLOC_MAX)
+		return slab_kmalloc(size);
+#endif
 
-		if (bh->size == size || ((bh->size > size) && (bh->size <= (size + sizeof(struct kheap_block_header))))) {
-			bh->free = false;
-			return (void*)((uint64_t)bh + sizeof(struct kheap_block_header));
-		} else if (bh->size > (size + sizeof(struct kheap_block_header))) {
-			kheap_create_block(bh, size);
-			bh->free = false;
-			return (void*)((uint64_t)bh + sizeof(struct kheap_block_header));
-		}
+	if (size >= KHEAP_LARGE_THRESHOLD)
+		return kheap_large_alloc(size, PAGE_SIZE, caller);
+
+#ifdef CONFIG_MM_DEBUG
+	size_t requested = size;
+	size += KHEAP_REDZONE_SIZE;
+#endif
+
+	if (size % 0x10 != 0) size = ALIGN_UP(size, 0x10);
+	if (size < KHEAP_MIN_SIZE) size = KHEAP_MIN_SIZE;
+
+	size_t searchSize = kheap_search_size(size);
+
+	spinlock_acquire(&kheapLock);
+
+	struct kheap_block_header* bh = kheap_find(searchSize);
+
+	if (!bh) {
+		kheap_extend(searchSize);
+		bh = kheap_find(searchSize);
 	}
 
-	kheap_extend(size);
+	kheap_block_use(bh, size);
+
+	spinlock_release(&kheapLock);
+
+#ifdef CONFIG_MM_DEBUG
+	kheap_debug_alloc(bh, requested, caller);
+#else
+	(void)caller;
+#endif
 
-	return kmalloc(size);
+	return kheap_block_data(bh);
+}
+
+void* kmalloc(size_t size) {
+	kheap_histogram_add(size);
+
+	return kheap_alloc(size, __builtin_return_address(0));
 }
 
 void* kzalloc(size_t size) {
-	void* ptr = kmalloc(size);
+	kheap_histogram_add(size);
+
+	void* ptr = kheap_alloc(size, __builtin_return_address(0));
 	memset(ptr, 0, size);
 
 	return ptr;
@@ -117,45 +630,200 @@ void kfree(void* ptr) {
 	if (ptr == NULL)
 		return;
 
-	struct kheap_block_header* bh = (struct kheap_block_header*)((uint64_t)ptr - sizeof(struct kheap_block_header));
+	if (slab_kfree(ptr) || kheap_large_free(ptr))
+		return;
+
+	struct kheap_block_header* bh = kheap_block_from_data(ptr);
 
-	if (bh->free) {
+#ifdef CONFIG_MM_DEBUG
+	if (bh->magic == KHEAP_BLOCK_MAGIC && (bh->flags & (KHEAP_BLOCK_FREE | KHEAP_BLOCK_QUARANTINE)))
+		debug_panic("Double kfree() of %p!\n", ptr);
+#endif
+
+	if (bh->magic != KHEAP_BLOCK_MAGIC || (bh->flags & KHEAP_BLOCK_FREE)) {
 		debug_log(LOGLEVEL_WARN, "Invalid kfree() address!\n");
 		return;
 	}
 
-	bh->free = true;
+#ifdef CONFIG_MM_DEBUG
+	kheap_debug_check_redzones(bh);
+	kheap_debug_account(bh->caller, bh->requested, false);
 
 	// Poison the block
-	memset((void*)((uint64_t)bh + sizeof(struct kheap_block_header)), 0xFF, bh->size);
+	memset(ptr, 0xFF, bh->size);
+
+	bh = kheap_debug_quarantine(bh);
+	if (!bh)
+		return;
+#endif
 
-	// Try to merge with the next/previous block.
+	spinlock_acquire(&kheapLock);
 
-	if (bh->next) {
-		if (bh->next->free && ((void*)((uint64_t)bh + (uint64_t)bh->size + sizeof(struct kheap_block_header)) == bh->next)) {
-			if (bh->next == blockListEnd)
-				blockListEnd = bh;
+	kheapInUse -= bh->size;
+	kheapUsedBlocks--;
 
-			bh->size += bh->next->size + sizeof(struct kheap_block_header);
+	// Merge with the next/previous block.
 
-			if (bh->next->next)
-				bh->next->next->prev = bh;
+	struct kheap_block_header* next = kheap_block_next(bh);
 
-			bh->next = bh->next->next;
-		}
+	if (next->flags & KHEAP_BLOCK_FREE) {
+		kheap_list_remove(next);
+		bh->size += next->size + KHEAP_HEADER_SIZE;
+		next->magic = 0;
+		kheapSizeUsable += KHEAP_HEADER_SIZE;
 	}
 
-	if (bh->prev) {
-		if (bh->prev->free && ((void*)((uint64_t)bh->prev + (uint64_t)bh->prev->size + sizeof(struct kheap_block_header)) == bh)) {
-			if (bh == blockListEnd)
-				blockListEnd = bh->prev;
+	if (bh->flags & KHEAP_BLOCK_PREV_FREE) {
+		struct kheap_block_header* prev = kheap_block_prev(bh);
+
+		kheap_list_remove(prev);
+		prev->size += bh->size + KHEAP_HEADER_SIZE;
+		bh->magic = 0;
+		bh = prev;
+		kheapSizeUsable += KHEAP_HEADER_SIZE;
+	}
+
+	bh->flags |= KHEAP_BLOCK_FREE;
+	kheap_block_next(bh)->flags |= KHEAP_BLOCK_PREV_FREE;
+
+	kheap_block_set_footer(bh);
+	kheap_list_insert(bh);
+
+	// Don't let a burst of allocations pin memory forever.
+	if (kheapSizeUsable - kheapInUse > KHEAP_TRIM_WATERMARK)
+		kheap_trim_block(bh);
+
+	spinlock_release(&kheapLock);
+}
+
+void* kmalloc_aligned(size_t size, size_t alignment) {
+	assert(alignment && !(alignment & (alignment - 1)), "kmalloc_aligned() alignment is not a power of two!\n");
+
+	kheap_histogram_add(size);
+
+	if (size >= KHEAP_LARGE_THRESHOLD || alignment >= PAGE_SIZE)
+		return kheap_large_alloc(size, alignment > PAGE_SIZE ? alignment : PAGE_SIZE, __builtin_return_address(0));
+
+	// Over-allocate and keep the original pointer right before the aligned
+	// one for kfree_aligned().
+	uint64_t base = (uint64_t)kheap_alloc(size + alignment + sizeof(void*), __builtin_return_address(0));
+	uint64_t addr = (base + sizeof(void*) + alignment - 1) & ~(uint64_t)(alignment - 1);
+
+	((void**)addr)[-1] = (void*)base;
+
+	return (void*)addr;
+}
+
+void kfree_aligned(void* ptr) {
+	if (ptr == NULL)
+		return;
+
+	if (kheap_large_free(ptr))
+		return;
+
+	kfree(((void**)ptr)[-1]);
+}
 
-			bh->prev->size += bh->size + sizeof(struct kheap_block_header);
+size_t kheap_trim(size_t keep) {
+	size_t released = 0;
 
-			if (bh->next)
-				bh->next->prev = bh->prev;
+	spinlock_acquire(&kheapLock);
 
-			bh->prev->next = bh->next;
+	// Start with the largest blocks. Blocks left over by kheap_trim_block()
+	// are smaller than a page, so they can only end up in lists that cannot
+	// be trimmed anyway.
+	for (int fl = KHEAP_FL_COUNT - 1; fl >= 0; fl--) {
+		for (int sl = KHEAP_SL_COUNT - 1; sl >= 0; sl--) {
+			struct kheap_block_header* bh = freeLists[fl][sl];
+
+			while (bh && kheapSizeUsable - kheapInUse > keep) {
+				struct kheap_block_header* next = bh->nextFree;
+				released += kheap_trim_block(bh);
+				bh = next;
+			}
+		}
+	}
+
+	spinlock_release(&kheapLock);
+
+	return released;
+}
+
+void kheap_stats(struct kheap_stats* stats) {
+	spinlock_acquire(&kheapLock);
+
+	stats->size = kheapSize;
+	stats->usable = kheapSizeUsable;
+	stats->inUse = kheapInUse;
+	stats->peakSize = kheapPeakSize;
+	stats->released = kheapReleased;
+	stats->usedBlocks = kheapUsedBlocks;
+	stats->freeBlocks = kheapFreeBlocks;
+	stats->largestFree = 0;
+
+	// The largest free block is in the highest non-empty free list.
+	if (flBitmap) {
+		int fl = 63 - __builtin_clzll(flBitmap);
+		int sl = 31 - __builtin_clz(slBitmap[fl]);
+
+		for (struct kheap_block_header* bh = freeLists[fl][sl]; bh; bh = bh->nextFree) {
+			if (bh->size > stats->largestFree)
+				stats->largestFree = bh->size;
 		}
 	}
+
+	spinlock_release(&kheapLock);
+
+	size_t free = stats->usable - stats->inUse;
+	stats->fragmentation = free ? 1000 - (int)(stats->largestFree * 1000 / free) : 0;
+
+	spinlock_acquire(&largeLock);
+	stats->largeSize = largeSize;
+	spinlock_release(&largeLock);
+
+	for (int i = 0; i < KHEAP_HISTOGRAM_BUCKETS; i++) {
+		stats->histogram[i] = 0;
+		for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+			stats->histogram[i] += sizeHistogram[cpu][i];
+	}
+}
+
+void kheap_dump_stats(void) {
+	struct kheap_stats stats;
+
+	kheap_stats(&stats);
+
+	debug_log(LOGLEVEL_INFO, "kheap: %zu bytes (peak %zu), %zu in use, %zu released, %zu in large allocations\n",
+		  stats.size, stats.peakSize, stats.inUse, stats.released, stats.largeSize);
+	debug_log(LOGLEVEL_INFO, "kheap: %zu used blocks, %zu free blocks, largest free block %zu bytes, fragmentation %d/1000\n",
+		  stats.usedBlocks, stats.freeBlocks, stats.largestFree, stats.fragmentation);
+
+	for (int i = 0; i < KHEAP_HISTOGRAM_BUCKETS; i++) {
+		if (!stats.histogram[i])
+			continue;
+
+		if (i == KHEAP_HISTOGRAM_BUCKETS - 1)
+			debug_log(LOGLEVEL_INFO, "kheap: kmalloc() > %zu bytes: %llu\n", (size_t)16 << (i - 1), stats.histogram[i]);
+		else
+			debug_log(LOGLEVEL_INFO, "kheap: kmalloc() <= %zu bytes: %llu\n", (size_t)16 << i, stats.histogram[i]);
+	}
+
+#ifdef CONFIG_MM_DEBUG
+	spinlock_acquire(&callsiteLock);
+
+	for (int i = 0; i < KHEAP_CALLSITE_COUNT; i++) {
+		struct kheap_callsite* site = &callsites[i];
+
+		if (!site->caller || !site->inUse)
+			continue;
+
+		debug_log(LOGLEVEL_INFO, "kheap: caller %p: %zu bytes in use, %llu allocs, %llu frees\n",
+			  site->caller, site->inUse, site->allocs, site->frees);
+	}
+
+	if (callsitesDropped)
+		debug_log(LOGLEVEL_WARN, "kheap: %llu allocations from untracked callers\n", callsitesDropped);
+
+	spinlock_release(&callsiteLock);
+#endif
 }
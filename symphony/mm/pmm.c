@@ -6,28 +6,155 @@
  * Copyright: BSD-2-Clause
  *
  * Description:
- * Bitmap-based page frame allocator.
+ * Buddy system page frame allocator.
  */
 
+#define LOG_SUBSYSTEM LOG_SUBSYS_MM
+
 #include <symphony/mm.h>
 #include <symphony/debug.h>
 #include <symphony/boot_proto.h>
+#include <symphony/spinlock.h>
+#include <symphony/error.h>
+
+// Free block header. Stored at the start of every free block (accessed via the
+// HHDM), so keeping track of free memory costs no memory at all.
+struct pmm_free_block {
+	struct pmm_free_block* next;
+	struct pmm_free_block* prev;
+	int order;
+};
+
+// Per-CPU page cache. Single page allocations and deallocations are served from
+// here without touching the global allocator, which is only accessed (under
+// pmmLock) to refill or drain the cache in batches.
+struct pmm_pcp {
+	uint64_t pages[PMM_PCP_SIZE];
+	int count;
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t drains;
+};
+
+static struct pmm_pcp pcp[MAX_CPUS];
+
+// Protects the free lists and the bitmap.
+static struct spinlock pmmLock = SPINLOCK_INIT;
+
+// Pool of free pages which have already been zeroed out. The pages are linked
+// together through their first 8 bytes, which are cleared again when a page
+// leaves the pool. Pages in the pool are marked as allocated in the bitmap.
+//
+// This is the only place zeroed memory is tracked: blocks on the buddy free
+// lists are always treated as dirty, so a freed page never comes back out as
+// zeroed. The pool is refilled by pmm_zero_idle(), which only pays off once
+// there is an idle loop calling it while the kernel runs.
+static uint64_t* zeroPool;
+static int zeroPoolCount;
+static struct spinlock zeroPoolLock = SPINLOCK_INIT;
+
+// Pool of huge pages reserved at boot. The pages are linked together through
+// their first 8 bytes and are marked as allocated in the bitmap.
+struct pmm_huge_pool {
+	uint64_t* head;
+	int order;
+	int count;
+	int reserved;
+};
+
+static struct pmm_huge_pool hugePools[] = {
+	{ .order = 18 }, // 1GiB
+	{ .order = 9 }   // 2MiB
+};
+
+// One free list per block order.
+static struct pmm_free_block* freeLists[PMM_MAX_ORDER + 1];
+
+// Summary of the free lists. Bit n is set if freeLists[n] is not empty, which
+// lets pmm_alloc() find the smallest usable block with a single ctz.
+static uint64_t freeListMask;
+
+// Number of free pages on the free lists and number of free blocks of each
+// order. Only used for statistics.
+static uint64_t freePages;
+static uint64_t freeBlocks[PMM_MAX_ORDER + 1];
+
+// Number of usable pages handed to the buddy allocator at boot.
+static uint64_t totalPages;
+
+// The bitmap keeps track of which pages are allocated (or unusable). A clear
+// bit means the page is part of a block that sits on one of the free lists.
+// Each 64-bit word tracks 64 pages, least significant bit first.
+static uint64_t* bitmap;
+static size_t bitmapWords;
+
+#ifdef CONFIG_MM_DEBUG
+// Per-page shadow state, used to catch pages freed twice (or never allocated).
+#define PMM_SHADOW_FREE 0
+#define PMM_SHADOW_ALLOCATED 1
+
+static uint8_t* pageShadow;
+#endif
+
+// Get a mask of the bits from `first` up to (not including) `last` in a
+// bitmap word.
+static inline uint64_t pmm_bitmap_mask(uint64_t first, uint64_t last) {
+	uint64_t mask = ~(uint64_t)0 << first;
+
+	if (last < 64)
+		mask &= ~(~(uint64_t)0 << last);
+
+	return mask;
+}
+
+// Mark a range of pages as allocated in the bitmap.
+static void pmm_bitmap_set_range(uint64_t page, uint64_t pages) {
+	assert((page + pages + 63)/64 <= bitmapWords, "PMM bitmap set operation out of bounds!\n");
+
+	uint64_t word = page/64;
+	uint64_t end = page + pages;
+	uint64_t endWord = end/64;
+
+	if (word == endWord) {
+		bitmap[word] |= pmm_bitmap_mask(page%64, end%64);
+		return;
+	}
+
+	bitmap[word] |= pmm_bitmap_mask(page%64, 64);
+	memset(&bitmap[word + 1], 0xff, (endWord - word - 1) * sizeof(uint64_t));
 
-static uint8_t* bitmap;
-static size_t bitmapSize;
+	if (end%64)
+		bitmap[endWord] |= pmm_bitmap_mask(0, end%64);
+}
+
+// Mark a range of pages as free in the bitmap.
+static void pmm_bitmap_clear_range(uint64_t page, uint64_t pages) {
+	assert((page + pages + 63)/64 <= bitmapWords, "PMM bitmap clear operation out of bounds!\n");
 
-// Mark page as allocated in the bitmap.
-static void pmm_bitmap_set(uint64_t page) {
-	assert(page/8 < bitmapSize, "PMM bitmap set operation out of bounds!\n");
+	uint64_t word = page/64;
+	uint64_t end = page + pages;
+	uint64_t endWord = end/64;
+
+	if (word == endWord) {
+		bitmap[word] &= ~pmm_bitmap_mask(page%64, end%64);
+		return;
+	}
 
-	bitmap[page/8] |= (0b10000000 >> (page%8));
+	bitmap[word] &= ~pmm_bitmap_mask(page%64, 64);
+	memset(&bitmap[word + 1], 0, (endWord - word - 1) * sizeof(uint64_t));
+
+	if (end%64)
+		bitmap[endWord] &= ~pmm_bitmap_mask(0, end%64);
 }
 
-// Mark page as free in the bitmap.
-static void pmm_bitmap_clear(uint64_t page) {
-	assert(page/8 < bitmapSize, "PMM bitmap clear operation out of bounds!\n");
+// Check whether a page is marked as allocated in the bitmap. Pages that are not
+// tracked by the bitmap are considered allocated.
+static bool pmm_bitmap_test(uint64_t page) {
+	if (page/64 >= bitmapWords)
+		return true;
 
-	bitmap[page/8] &= ~((0b10000000 >> (page%8)));
+	return bitmap[page/64] & ((uint64_t)1 << (page%64));
 }
 
 // We dont need to track every page in the physical address space. The last
@@ -46,39 +173,198 @@ static uint64_t pmm_bitmap_last_tracked_page() {
 	return 0;
 }
 
-// Find free pages using the bitmap.
-static uint64_t pmm_find_free_pages(int pages) {
-	bool inChunk = false;
-	int pagesFoundInChunk = 0;
-	uint64_t basePage;
+// Get the free block header of a page.
+static inline struct pmm_free_block* pmm_block_header(uint64_t page) {
+	return (struct pmm_free_block*)((page << 12) + boot_proto_hhdm_offset());
+}
+
+// Get the page index of a free block header.
+static inline uint64_t pmm_block_page(struct pmm_free_block* block) {
+	return ((uint64_t)block - boot_proto_hhdm_offset()) >> 12;
+}
 
-	for (size_t i = 0; i < bitmapSize; i++) {
-		for (uint8_t j = 0; j < 8; j++) {
-			if (!(bitmap[i] & (0b10000000 >> j))) {
-				if (!inChunk) {
-					basePage = (i*8)+j;
-					inChunk = true;
-				}
+// Push a block on its free list.
+static void pmm_list_push(uint64_t page, int order) {
+	struct pmm_free_block* block = pmm_block_header(page);
 
-				pagesFoundInChunk++;
-				if (pagesFoundInChunk == pages)
-					return basePage;
-			} else {
-				inChunk = false;
-				pagesFoundInChunk = 0;
-			}
+	block->order = order;
+	block->prev = NULL;
+	block->next = freeLists[order];
+	if (block->next)
+		block->next->prev = block;
+
+	freeLists[order] = block;
+	freeListMask |= (uint64_t)1 << order;
+
+	freePages += (uint64_t)1 << order;
+	freeBlocks[order]++;
+}
+
+// Remove a block from its free list.
+static void pmm_list_remove(struct pmm_free_block* block) {
+	if (block->prev)
+		block->prev->next = block->next;
+	else
+		freeLists[block->order] = block->next;
+
+	if (!freeLists[block->order])
+		freeListMask &= ~((uint64_t)1 << block->order);
+
+	if (block->next)
+		block->next->prev = block->prev;
+
+	freePages -= (uint64_t)1 << block->order;
+	freeBlocks[block->order]--;
+}
+
+// Get the smallest order that can hold the specified number of pages.
+static int pmm_pages_to_order(uint64_t pages) {
+	int order = 0;
+
+	while (((uint64_t)1 << order) < pages)
+		order++;
+
+	return order;
+}
+
+// Return a block of 2^order pages to the free lists, merging it with its buddy
+// for as long as possible. All pages of the block must be marked as allocated.
+static void pmm_free_block(uint64_t page, int order) {
+	pmm_bitmap_clear_range(page, (uint64_t)1 << order);
+
+	while (order < PMM_MAX_ORDER) {
+		uint64_t buddy = page ^ ((uint64_t)1 << order);
+
+		// A clear bit on the buddy's first page means the buddy is the head of
+		// a free block. Only merge if that block is exactly as large as ours.
+		if (pmm_bitmap_test(buddy))
+			break;
+
+		struct pmm_free_block* buddyBlock = pmm_block_header(buddy);
+		if (buddyBlock->order != order)
+			break;
+
+		pmm_list_remove(buddyBlock);
+
+		page &= ~((uint64_t)1 << order);
+		order++;
+	}
+
+	pmm_list_push(page, order);
+}
+
+// Return an arbitrary range of allocated pages to the free lists by splitting it
+// into the largest naturally aligned blocks possible.
+static void pmm_free_range(uint64_t page, uint64_t pages) {
+	while (pages) {
+		int order = page ? __builtin_ctzll(page) : PMM_MAX_ORDER;
+		if (order > PMM_MAX_ORDER)
+			order = PMM_MAX_ORDER;
+
+		while (((uint64_t)1 << order) > pages)
+			order--;
+
+		pmm_free_block(page, order);
+
+		page += (uint64_t)1 << order;
+		pages -= (uint64_t)1 << order;
+	}
+}
+
+// Check whether the buddy allocator has a free block of at least 2^order pages.
+static bool pmm_buddy_fits(int order) {
+	return order <= PMM_MAX_ORDER && (freeListMask >> order);
+}
+
+// Allocate pages from the start of a block of 2^order pages, which means the
+// pages are aligned on a 2^order page boundary. The order must be large enough
+// to hold all the pages. pmmLock must be held.
+static uint64_t pmm_buddy_alloc(uint64_t pages, int order) {
+	if (!pmm_buddy_fits(order))
+		debug_panic("Out of Memory!");
+
+	int current = order + __builtin_ctzll(freeListMask >> order);
+
+	struct pmm_free_block* block = freeLists[current];
+	pmm_list_remove(block);
+
+	uint64_t base = pmm_block_page(block);
+
+	// Split the block until it is just as large as it needs to be. The upper
+	// halves go back on the free lists.
+	while (current > order) {
+		current--;
+		pmm_list_push(base + ((uint64_t)1 << current), current);
+	}
+
+	pmm_bitmap_set_range(base, (uint64_t)1 << order);
+
+	// Give back whatever is left past the requested size, so allocations which
+	// are not a power of two do not waste memory.
+	if (((uint64_t)1 << order) > (uint64_t)pages)
+		pmm_free_range(base + pages, ((uint64_t)1 << order) - pages);
+
+	return base;
+}
+
+// Reserve huge pages for a huge page pool.
+static void pmm_huge_pool_reserve(struct pmm_huge_pool* pool, int count) {
+	for (int i = 0; i < count; i++) {
+		if (!pmm_buddy_fits(pool->order)) {
+			debug_log(LOGLEVEL_WARN, "Could only reserve %d out of %d huge pages of order %d\n", i, count, pool->order);
+			break;
 		}
+
+		uint64_t* page = (uint64_t*)((pmm_buddy_alloc((uint64_t)1 << pool->order, pool->order) << 12) + boot_proto_hhdm_offset());
+
+		*page = (uint64_t)pool->head;
+		pool->head = page;
+		pool->count++;
+		pool->reserved++;
+	}
+}
+
+// Get the huge page pool for a huge page size.
+static struct pmm_huge_pool* pmm_huge_pool(size_t size) {
+	for (size_t i = 0; i < sizeof(hugePools)/sizeof(hugePools[0]); i++) {
+		if (((size_t)PAGE_SIZE << hugePools[i].order) == size)
+			return &hugePools[i];
+	}
+
+	return NULL;
+}
+
+#ifdef CONFIG_MM_DEBUG
+// Record an allocation in the shadow state.
+static void pmm_debug_alloc(uint64_t page, uint64_t pages) {
+	if (!pageShadow)
+		return;
+
+	for (uint64_t i = page; i < page + pages; i++) {
+		if (pageShadow[i] == PMM_SHADOW_ALLOCATED)
+			debug_panic("PMM handed out page %#llx twice!\n", i << 12);
+
+		pageShadow[i] = PMM_SHADOW_ALLOCATED;
 	}
+}
 
-	debug_panic("Out of Memory!");
-	
-	__builtin_unreachable();
+// Check a deallocation against the shadow state and poison the freed pages.
+static void pmm_debug_free(uint64_t page, uint64_t pages) {
+	for (uint64_t i = page; pageShadow && i < page + pages; i++) {
+		if (pageShadow[i] != PMM_SHADOW_ALLOCATED)
+			debug_panic("Double free of page %#llx!\n", i << 12);
+
+		pageShadow[i] = PMM_SHADOW_FREE;
+	}
+
+	memset((void*)((page << 12) + boot_proto_hhdm_offset()), 0xff, PAGE_SIZE*pages);
 }
+#endif
 
 int pmm_init(void) {
-	bitmapSize = ALIGN_UP(pmm_bitmap_last_tracked_page(), 8) / 8;
-	
-	assert(bitmapSize, "Something is wrong with the PMM bitmap size!\n");
+	bitmapWords = ALIGN_UP(pmm_bitmap_last_tracked_page(), 64) / 64;
+
+	assert(bitmapWords, "Something is wrong with the PMM bitmap size!\n");
 
 	struct boot_proto_memmap_entry entry;
 
@@ -96,57 +382,449 @@ int pmm_init(void) {
 				entry.length = 0;
 		}
 
-		if (entry.length >= bitmapSize) {
-			bitmap = (uint8_t*)(entry.base + boot_proto_hhdm_offset());
+		if (entry.length >= bitmapWords * sizeof(uint64_t)) {
+			bitmap = (uint64_t*)(entry.base + boot_proto_hhdm_offset());
 			break;
 		}
 	}
 
 	assert((uint64_t)bitmap, "Bitmap not properly allocated!\n");
 
-	memset(bitmap, 0xff, bitmapSize);
+	// Everything starts out as allocated. Usable memory is then handed to the
+	// buddy allocator, which clears the bits as it goes.
+	memset(bitmap, 0xff, bitmapWords * sizeof(uint64_t));
+
+	uint64_t bitmapPhysAddr = ((uint64_t)bitmap - boot_proto_hhdm_offset());
+	uint64_t bitmapEnd = bitmapPhysAddr + ALIGN_UP(bitmapWords * sizeof(uint64_t), PAGE_SIZE);
 
 	for (uint64_t i = 0; i < boot_proto_memmap_entry_count(); i++) {
 		entry = boot_proto_memmap_entry_get(i);
 
-		// Mark all "Usable" memmap entries as free.
 		if (entry.type != BOOT_PROTO_MEMMAP_USABLE)
 			continue;
 
-		for (uint64_t j = (entry.base >> 12); j < ((entry.base + entry.length) >> 12); j++)
-			pmm_bitmap_clear(j);
+		uint64_t start = entry.base;
+		uint64_t end = entry.base + entry.length;
+
+		// The first page (page 0) is never used.
+		if (start == 0)
+			start = PAGE_SIZE;
+
+		// Skip the pages used by the bitmap itself.
+		if (bitmapPhysAddr >= start && bitmapPhysAddr < end)
+			start = bitmapEnd;
+
+		if (start >= end)
+			continue;
+
+		pmm_free_range(start >> 12, (end >> 12) - (start >> 12));
+		totalPages += (end >> 12) - (start >> 12);
 	}
 
-	// Now, mark all the bitmap pages as allocated.
-	
-	uint64_t bitmapPhysAddr = ((uint64_t)bitmap - boot_proto_hhdm_offset());
+	// Reserve the huge page pools. Do the larger pages first, before the
+	// smaller reservations get a chance to break up the large blocks.
+	pmm_huge_pool_reserve(pmm_huge_pool(HUGE_PAGE_SIZE_1G), PMM_HUGE_POOL_1G);
+	pmm_huge_pool_reserve(pmm_huge_pool(HUGE_PAGE_SIZE_2M), PMM_HUGE_POOL_2M);
 
-	for (uint64_t i = bitmapPhysAddr; i < bitmapPhysAddr + ALIGN_UP(bitmapSize, PAGE_SIZE); i+=PAGE_SIZE)
-		pmm_bitmap_set(i/PAGE_SIZE);
+#ifdef CONFIG_MM_DEBUG
+	uint64_t shadowPages = ALIGN_UP(bitmapWords * 64, PAGE_SIZE) / PAGE_SIZE;
+	void* shadow = pmm_alloc_flags(shadowPages, PMM_ZERO);
 
-	// Also, the first page (page 0) is never used, so it should be marked
-	// as allocated as well.
-	pmm_bitmap_set(0);
+	pageShadow = (uint8_t*)((uint64_t)shadow + boot_proto_hhdm_offset());
+	pmm_debug_alloc((uint64_t)shadow >> 12, shadowPages);
+#endif
 
 	debug_log(LOGLEVEL_INFO, "PMM initialized\n");
 
 	return 0;
 }
 
+// Take a page from the zeroed page pool. Returns NULL if the pool is empty.
+static void* pmm_zero_pool_pop(void) {
+	spinlock_acquire(&zeroPoolLock);
+
+	uint64_t* page = zeroPool;
+	if (page) {
+		zeroPool = (uint64_t*)*page;
+		zeroPoolCount--;
+	}
+
+	spinlock_release(&zeroPoolLock);
+
+	if (!page)
+		return NULL;
+
+	*page = 0;
+
+	return (void*)((uint64_t)page - boot_proto_hhdm_offset());
+}
+
+// Move a batch of pages from the global allocator to a page cache.
+static void pmm_pcp_refill(struct pmm_pcp* cache) {
+	int pages = PMM_PCP_BATCH;
+
+	if (pages > PMM_PCP_SIZE - cache->count)
+		pages = PMM_PCP_SIZE - cache->count;
+
+	spinlock_acquire(&pmmLock);
+
+	// Carve the whole batch out of a single block if possible. Taking the
+	// pages one by one would pick up scattered leftovers from other
+	// allocations and keep large blocks from ever merging again.
+	if (pmm_buddy_fits(pmm_pages_to_order(pages))) {
+		uint64_t base = pmm_buddy_alloc(pages, pmm_pages_to_order(pages));
+
+		for (int i = pages - 1; i >= 0; i--)
+			cache->pages[cache->count++] = base + i;
+	} else {
+		for (int i = 0; i < pages && freeListMask; i++)
+			cache->pages[cache->count++] = pmm_buddy_alloc(1, 0);
+	}
+
+	spinlock_release(&pmmLock);
+
+	// The zeroed page pool is free memory too. Fall back to it before
+	// running out of memory.
+	if (!cache->count) {
+		void* page = pmm_zero_pool_pop();
+
+		if (!page)
+			debug_panic("Out of Memory!");
+
+		cache->pages[cache->count++] = (uint64_t)page >> 12;
+	}
+}
+
+// Move up to `pages` pages from a page cache back to the global allocator.
+static void pmm_pcp_drain(struct pmm_pcp* cache, int pages) {
+	spinlock_acquire(&pmmLock);
+
+	for (int i = 0; i < pages && cache->count; i++)
+		pmm_free_range(cache->pages[--cache->count], 1);
+
+	spinlock_release(&pmmLock);
+
+	cache->drains++;
+}
+
+// Allocate contiguous pages from a block of 2^order pages.
+static uint64_t pmm_alloc_contiguous(int pages, int order) {
+	// Cached pages keep free blocks from merging. Give them back before
+	// running out of memory.
+	if (!pmm_buddy_fits(order))
+		pmm_pcp_drain(&pcp[arch_cpu_current()], PMM_PCP_SIZE);
+
+	spinlock_acquire(&pmmLock);
+	uint64_t base = pmm_buddy_alloc(pages, order);
+	spinlock_release(&pmmLock);
+
+	return base;
+}
+
 void* pmm_alloc(int pages) {
-	uint64_t base = pmm_find_free_pages(pages);
+	return pmm_alloc_flags(pages, 0);
+}
+
+void* pmm_alloc_flags(int pages, int flags) {
+	assert(pages > 0, "Invalid PMM allocation size!\n");
+
+	if ((flags & PMM_ZERO) && pages == 1) {
+		void* page = pmm_zero_pool_pop();
+		if (page) {
+#ifdef CONFIG_MM_DEBUG
+			pmm_debug_alloc((uint64_t)page >> 12, 1);
+#endif
+			return page;
+		}
+	}
+
+	uint64_t base;
+
+	if (pages == 1) {
+		struct pmm_pcp* cache = &pcp[arch_cpu_current()];
+
+		if (cache->count) {
+			cache->hits++;
+		} else {
+			cache->misses++;
+			pmm_pcp_refill(cache);
+		}
+
+		base = cache->pages[--cache->count];
+	} else {
+		base = pmm_alloc_contiguous(pages, pmm_pages_to_order(pages));
+	}
+
+#ifdef CONFIG_MM_DEBUG
+	pmm_debug_alloc(base, pages);
+#endif
 
-	for (uint64_t i = base; i < base + pages; i++)
-		pmm_bitmap_set(i);
+	if (flags & PMM_ZERO)
+		clear_pages((void*)((base << 12) + boot_proto_hhdm_offset()), pages);
 
 	return (void*)(base << 12);
 }
 
+void* pmm_alloc_aligned(int pages, size_t alignment, int flags) {
+	assert(pages > 0, "Invalid PMM allocation size!\n");
+	assert(alignment && !(alignment & (alignment - 1)), "PMM allocation alignment is not a power of two!\n");
+
+	int order = pmm_pages_to_order(pages);
+	int alignmentOrder = alignment > PAGE_SIZE ? __builtin_ctzll(alignment) - 12 : 0;
+
+	if (alignmentOrder > order)
+		order = alignmentOrder;
+
+	uint64_t base = pmm_alloc_contiguous(pages, order);
+
+#ifdef CONFIG_MM_DEBUG
+	pmm_debug_alloc(base, pages);
+#endif
+
+	if (flags & PMM_ZERO)
+		clear_pages((void*)((base << 12) + boot_proto_hhdm_offset()), pages);
+
+	return (void*)(base << 12);
+}
+
+void* pmm_alloc_huge(size_t size, int flags) {
+	struct pmm_huge_pool* pool = pmm_huge_pool(size);
+	if (!pool)
+		return NULL;
+
+	spinlock_acquire(&pmmLock);
+
+	uint64_t* page = pool->head;
+	if (page) {
+		pool->head = (uint64_t*)*page;
+		pool->count--;
+	}
+
+	spinlock_release(&pmmLock);
+
+	// Fall back to the buddy allocator if the pool ran dry.
+	if (!page)
+		return pmm_alloc_aligned(size/PAGE_SIZE, size, flags);
+
+	if (flags & PMM_ZERO)
+		clear_pages(page, size/PAGE_SIZE);
+	else
+		*page = 0;
+
+#ifdef CONFIG_MM_DEBUG
+	pmm_debug_alloc(((uint64_t)page - boot_proto_hhdm_offset()) >> 12, size/PAGE_SIZE);
+#endif
+
+	return (void*)((uint64_t)page - boot_proto_hhdm_offset());
+}
+
+int pmm_free_huge(void* base, size_t size) {
+	struct pmm_huge_pool* pool = pmm_huge_pool(size);
+	if (!pool || ((uint64_t)base & (size - 1)))
+		return -EINVAL;
+
+	spinlock_acquire(&pmmLock);
+
+	// Refill the pool up to its reserved size before giving anything back
+	// to the buddy allocator.
+	if (pool->count < pool->reserved) {
+		uint64_t* page = (uint64_t*)((uint64_t)base + boot_proto_hhdm_offset());
+
+#ifdef CONFIG_MM_DEBUG
+		pmm_debug_free((uint64_t)base >> 12, size/PAGE_SIZE);
+#endif
+
+		*page = (uint64_t)pool->head;
+		pool->head = page;
+		pool->count++;
+
+		spinlock_release(&pmmLock);
+
+		return 0;
+	}
+
+	spinlock_release(&pmmLock);
+
+	return pmm_free(base, size/PAGE_SIZE);
+}
+
 int pmm_free(void* base, int pages) {
-	for (uint64_t i = ((uint64_t)base >> 12); i < ((uint64_t)base >> 12) + pages; i++)
-		pmm_bitmap_clear(i);
+#ifdef CONFIG_MM_DEBUG
+	pmm_debug_free((uint64_t)base >> 12, pages);
+#endif
+
+	if (pages == 1) {
+		struct pmm_pcp* cache = &pcp[arch_cpu_current()];
+
+		if (cache->count == PMM_PCP_SIZE)
+			pmm_pcp_drain(cache, PMM_PCP_BATCH);
+
+		cache->pages[cache->count++] = (uint64_t)base >> 12;
+
+		return 0;
+	}
+
+	spinlock_acquire(&pmmLock);
+	pmm_free_range((uint64_t)base >> 12, pages);
+	spinlock_release(&pmmLock);
+
+	return 0;
+}
+
+int pmm_pcp_stats(int cpu, struct pmm_pcp_stats* stats) {
+	if (cpu < 0 || cpu >= MAX_CPUS || !stats)
+		return -EINVAL;
+
+	stats->hits = pcp[cpu].hits;
+	stats->misses = pcp[cpu].misses;
+	stats->drains = pcp[cpu].drains;
+	stats->count = pcp[cpu].count;
 
-	memset(base + boot_proto_hhdm_offset(), 0xff, PAGE_SIZE*pages);
+	return 0;
+}
+
+bool pmm_zero_idle(void) {
+	// Do not hoard the last free pages.
+	if (zeroPoolCount >= PMM_ZERO_POOL_SIZE || !freeListMask)
+		return false;
+
+	uint64_t* page = (uint64_t*)((uint64_t)pmm_alloc(1) + boot_proto_hhdm_offset());
+	clear_page(page);
+
+#ifdef CONFIG_MM_DEBUG
+	// Pages in the pool count as free.
+	pageShadow[((uint64_t)page - boot_proto_hhdm_offset()) >> 12] = PMM_SHADOW_FREE;
+#endif
+
+	spinlock_acquire(&zeroPoolLock);
+
+	*page = (uint64_t)zeroPool;
+	zeroPool = page;
+	zeroPoolCount++;
+
+	spinlock_release(&zeroPoolLock);
+
+	return zeroPoolCount < PMM_ZERO_POOL_SIZE;
+}
+
+uint64_t pmm_page_count(void) {
+	return bitmapWords * 64;
+}
+
+void pmm_stats(struct pmm_stats* stats) {
+	spinlock_acquire(&pmmLock);
+
+	stats->totalPages = totalPages;
+	stats->freePages = freePages;
+	stats->largestFreeBlock = freeListMask ? (uint64_t)1 << (63 - __builtin_clzll(freeListMask)) : 0;
+	memcpy(stats->freeBlocks, freeBlocks, sizeof(freeBlocks));
+
+	stats->cachedPages = 0;
+	for (size_t i = 0; i < sizeof(hugePools)/sizeof(hugePools[0]); i++)
+		stats->cachedPages += (uint64_t)hugePools[i].count << hugePools[i].order;
+
+	spinlock_release(&pmmLock);
+
+	for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+		stats->cachedPages += pcp[cpu].count;
+
+	stats->cachedPages += zeroPoolCount;
+}
+
+int pmm_fragmentation(int order) {
+	if (order < 0 || order > PMM_MAX_ORDER)
+		return -EINVAL;
+
+	spinlock_acquire(&pmmLock);
+
+	// Free pages in blocks too small for the allocation.
+	uint64_t unusable = 0;
+	for (int i = 0; i < order; i++)
+		unusable += freeBlocks[i] << i;
+
+	uint64_t free = freePages;
+
+	spinlock_release(&pmmLock);
+
+	if (!free)
+		return 1000;
+
+	return (int)(unusable * 1000 / free);
+}
+
+int pmm_region_stats(uint64_t index, struct pmm_region_stats* stats) {
+	if (index >= boot_proto_memmap_entry_count() || !stats)
+		return -EINVAL;
+
+	struct boot_proto_memmap_entry entry = boot_proto_memmap_entry_get(index);
+	if (entry.type != BOOT_PROTO_MEMMAP_USABLE)
+		return -EINVAL;
+
+	uint64_t first = entry.base >> 12;
+	uint64_t last = (entry.base + entry.length) >> 12;
+	uint64_t run = 0;
+
+	stats->base = entry.base;
+	stats->length = entry.length;
+	stats->freePages = 0;
+	stats->largestFreeRun = 0;
+
+	spinlock_acquire(&pmmLock);
+
+	for (uint64_t page = first; page < last;) {
+		// Skip over whole words which are either all free or all allocated.
+		if (!(page % 64) && page + 64 <= last && page/64 < bitmapWords &&
+		    (bitmap[page/64] == 0 || bitmap[page/64] == ~(uint64_t)0)) {
+			if (bitmap[page/64]) {
+				run = 0;
+			} else {
+				stats->freePages += 64;
+				run += 64;
+			}
+
+			page += 64;
+		} else {
+			if (pmm_bitmap_test(page)) {
+				run = 0;
+			} else {
+				stats->freePages++;
+				run++;
+			}
+
+			page++;
+		}
+
+		if (run > stats->largestFreeRun)
+			stats->largestFreeRun = run;
+	}
+
+	spinlock_release(&pmmLock);
+
+	stats->usedPages = (last - first) - stats->freePages;
 
 	return 0;
 }
+
+void pmm_dump_stats(void) {
+	struct pmm_stats stats;
+	struct pmm_region_stats region;
+
+	pmm_stats(&stats);
+
+	debug_log(LOGLEVEL_INFO, "pmm: %llu pages total, %llu free, %llu cached, largest free block %llu pages\n",
+		  stats.totalPages, stats.freePages, stats.cachedPages, stats.largestFreeBlock);
+
+	for (int order = 0; order <= PMM_MAX_ORDER; order++) {
+		if (stats.freeBlocks[order])
+			debug_log(LOGLEVEL_INFO, "pmm: order %d: %llu free blocks, fragmentation %d/1000\n",
+				  order, stats.freeBlocks[order], pmm_fragmentation(order));
+	}
+
+	for (uint64_t i = 0; i < boot_proto_memmap_entry_count(); i++) {
+		if (pmm_region_stats(i, &region) != 0)
+			continue;
+
+		debug_log(LOGLEVEL_INFO, "pmm: region %#llx->%#llx: %llu free, %llu used, largest free run %llu pages\n",
+			  region.base, region.base + region.length, region.freePages, region.usedPages, region.largestFreeRun);
+	}
+}
@@ -0,0 +1,531 @@
+/*
+ * File: mm/slab.c
+ * 
+ * Authos(s): Popa Vlad (Garnek0)
+ *
+ * Copyright: BSD-2-Clause
+ *
+ * Description:
+ * Slab allocator. Objects of the same size are served from caches of slabs,
+ * each slab being a naturally aligned block of pages with a small header
+ * followed by the objects themselves.
+ */
+
+#define LOG_SUBSYSTEM LOG_SUBSYS_MM
+
+#include <symphony/mm.h>
+#include <symphony/boot_proto.h>
+#include <symphony/string.h>
+#include <symphony/spinlock.h>
+#include <symphony/debug.h>
+
+// Number of empty slabs a cache keeps around instead of giving them back to
+// the PMM.
+#define KMEM_CACHE_EMPTY_MAX 1
+
+// Objects which don't fit this many times in a single page get multi-page slabs.
+#define KMEM_SLAB_MIN_OBJECTS 8
+
+// Number of objects in the per-CPU magazine of a cache, and the number of
+// objects moved between a magazine and the slabs at once.
+#define KMEM_MAGAZINE_SIZE 32
+#define KMEM_MAGAZINE_BATCH 16
+
+// Number of slots in a per-CPU remote free queue. Must be a power of two.
+#define KMEM_REMOTE_QUEUE_SIZE 64
+
+// Smallest kmalloc() size class (log2).
+#define SLAB_KMALLOC_MIN_SHIFT 4
+
+// Number of kmalloc() size classes (16, 32, ..., SLAB_KMALLOC_MAX bytes).
+#define SLAB_KMALLOC_CLASSES 6
+
+struct kmem_slab {
+	struct kmem_cache* cache;
+	struct kmem_slab* next;
+	struct kmem_slab* prev;
+
+	// CPU which allocated the slab. Objects freed on other CPUs are sent
+	// back to it.
+	int cpu;
+
+	void* objects;
+	uint16_t freeCount;
+
+	// Stack of free object indexes. The object data is never touched while
+	// the object is free, so constructed objects stay constructed.
+	uint16_t freeStack[];
+};
+
+struct kmem_remote_slot {
+	uint64_t seq;
+	void* obj;
+};
+
+// Per-CPU part of a cache.
+struct kmem_cpu_cache {
+	// Objects ready to be handed out without taking the cache lock.
+	void* magazine[KMEM_MAGAZINE_SIZE];
+	int count;
+
+	// Bounded lock-free queue of objects from this CPU's slabs freed on other
+	// CPUs. Any CPU can push, only the owner pops.
+	struct kmem_remote_slot remote[KMEM_REMOTE_QUEUE_SIZE];
+	uint64_t remoteHead;
+	uint64_t remoteTail;
+
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t remoteFrees;
+};
+
+struct kmem_cache {
+	const char* name;
+	size_t objectSize;
+	size_t align;
+	int slabPages;
+	uint16_t objectsPerSlab;
+	void (*ctor)(void* obj);
+
+	struct kmem_slab* partial;
+	struct kmem_slab* full;
+	struct kmem_slab* empty;
+	int emptyCount;
+
+	struct spinlock lock;
+
+	size_t slabs;
+
+	// Objects taken out of the slabs, including those in the magazines.
+	size_t inUse;
+
+	struct kmem_cpu_cache cpu[MAX_CPUS];
+
+	struct kmem_cache* next;
+};
+
+// The cache all other caches are allocated from.
+static struct kmem_cache cacheCache;
+
+static struct kmem_cache* cacheList;
+static struct spinlock cacheListLock = SPINLOCK_INIT;
+
+static struct kmem_cache* kmallocCaches[SLAB_KMALLOC_CLASSES];
+static const char* kmallocCacheNames[SLAB_KMALLOC_CLASSES] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256", "kmalloc-512"
+};
+
+// Bitmap of the physical pages holding single-page slabs. Used by kfree() to
+// find out whether memory belongs to a slab.
+static uint64_t* slabPageMap;
+static uint64_t slabPageCount;
+
+static void kmem_slab_push(struct kmem_slab** list, struct kmem_slab* slab) {
+	slab->prev = NULL;
+	slab->next = *list;
+	if (*list)
+		(*list)->prev = slab;
+	*list = slab;
+}
+
+static void kmem_slab_remove(struct kmem_slab** list, struct kmem_slab* slab) {
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		*list = slab->next;
+
+	if (slab->next)
+		slab->next->prev = slab->prev;
+}
+
+static void slab_page_map_set(uint64_t page, bool value) {
+	if (!slabPageMap || page >= slabPageCount)
+		return;
+
+	if (value)
+		__atomic_or_fetch(&slabPageMap[page / 64], (uint64_t)1 << (page % 64), __ATOMIC_RELAXED);
+	else
+		__atomic_and_fetch(&slabPageMap[page / 64], ~((uint64_t)1 << (page % 64)), __ATOMIC_RELAXED);
+}
+
+// Work out the slab size and the number of objects per slab of a cache.
+static void kmem_cache_layout(struct kmem_cache* cache) {
+	cache->slabPages = 1;
+
+	if (cache->objectSize > PAGE_SIZE / KMEM_SLAB_MIN_OBJECTS) {
+		while ((uint64_t)cache->slabPages * PAGE_SIZE < sizeof(struct kmem_slab) + KMEM_SLAB_MIN_OBJECTS * (cache->objectSize + sizeof(uint16_t)))
+			cache->slabPages <<= 1;
+	}
+
+	size_t slabSize = (size_t)cache->slabPages * PAGE_SIZE;
+	size_t objects = (slabSize - sizeof(struct kmem_slab)) / (cache->objectSize + sizeof(uint16_t));
+
+	while (objects) {
+		size_t headerSize = sizeof(struct kmem_slab) + objects * sizeof(uint16_t);
+
+		if (ALIGN_UP(headerSize, cache->align) + objects * cache->objectSize <= slabSize)
+			break;
+
+		objects--;
+	}
+
+	if (objects > UINT16_MAX)
+		objects = UINT16_MAX;
+
+	cache->objectsPerSlab = objects;
+}
+
+static void kmem_cache_setup(struct kmem_cache* cache, const char* name, size_t size, size_t align, void (*ctor)(void* obj)) {
+	memset(cache, 0, sizeof(struct kmem_cache));
+
+	if (align < sizeof(uint64_t))
+		align = sizeof(uint64_t);
+	if (!size)
+		size = 1;
+
+	cache->name = name;
+	cache->align = align;
+	cache->objectSize = ALIGN_UP(size, align);
+	cache->ctor = ctor;
+
+	kmem_cache_layout(cache);
+
+	for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		for (int i = 0; i < KMEM_REMOTE_QUEUE_SIZE; i++)
+			cache->cpu[cpu].remote[i].seq = i;
+	}
+
+	assert(cache->objectsPerSlab, "Slab cache object size too large!\n");
+
+	spinlock_acquire(&cacheListLock);
+	cache->next = cacheList;
+	cacheList = cache;
+	spinlock_release(&cacheListLock);
+}
+
+// Allocate a new slab for a cache and construct its objects.
+static struct kmem_slab* kmem_slab_new(struct kmem_cache* cache) {
+	uint64_t phys = (uint64_t)pmm_alloc_aligned(cache->slabPages, (size_t)cache->slabPages * PAGE_SIZE, 0);
+	struct kmem_slab* slab = (struct kmem_slab*)(phys + boot_proto_hhdm_offset());
+
+	slab->cache = cache;
+	slab->next = slab->prev = NULL;
+	slab->cpu = arch_cpu_current();
+	uint64_t headerEnd = (uint64_t)slab + sizeof(struct kmem_slab) + cache->objectsPerSlab * sizeof(uint16_t);
+
+	slab->objects = (void*)ALIGN_UP(headerEnd, cache->align);
+	slab->freeCount = cache->objectsPerSlab;
+
+	// Hand out objects in address order.
+	for (uint16_t i = 0; i < cache->objectsPerSlab; i++)
+		slab->freeStack[i] = cache->objectsPerSlab - 1 - i;
+
+	if (cache->ctor) {
+		for (uint16_t i = 0; i < cache->objectsPerSlab; i++)
+			cache->ctor((void*)((uint64_t)slab->objects + i * cache->objectSize));
+	}
+
+	if (cache->slabPages == 1)
+		slab_page_map_set(phys / PAGE_SIZE, true);
+
+	cache->slabs++;
+
+	return slab;
+}
+
+static void kmem_slab_free(struct kmem_slab* slab) {
+	struct kmem_cache* cache = slab->cache;
+	uint64_t phys = (uint64_t)slab - boot_proto_hhdm_offset();
+
+	if (cache->slabPages == 1)
+		slab_page_map_set(phys / PAGE_SIZE, false);
+
+	cache->slabs--;
+
+	pmm_free((void*)phys, cache->slabPages);
+}
+
+int slab_init(void) {
+	kmem_cache_setup(&cacheCache, "kmem_cache", sizeof(struct kmem_cache), 0, NULL);
+
+	slabPageCount = pmm_page_count();
+	size_t mapSize = ALIGN_UP(slabPageCount, 64) / 8;
+	size_t mapPages = ALIGN_UP(mapSize, PAGE_SIZE) / PAGE_SIZE;
+	slabPageMap = (uint64_t*)((uint64_t)pmm_alloc_flags(mapPages, PMM_ZERO) + boot_proto_hhdm_offset());
+
+	for (int i = 0; i < SLAB_KMALLOC_CLASSES; i++)
+		kmallocCaches[i] = kmem_cache_create(kmallocCacheNames[i], (size_t)1 << (i + SLAB_KMALLOC_MIN_SHIFT), 16, NULL);
+
+	debug_log(LOGLEVEL_INFO, "Slab allocator initialized\n");
+
+	return 0;
+}
+
+struct kmem_cache* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void* obj)) {
+	struct kmem_cache* cache = (struct kmem_cache*)kmem_cache_alloc(&cacheCache);
+
+	kmem_cache_setup(cache, name, size, align, ctor);
+
+	return cache;
+}
+
+// Take an object out of the slabs. The cache lock must be held.
+static void* kmem_cache_alloc_locked(struct kmem_cache* cache) {
+	struct kmem_slab* slab = cache->partial;
+
+	if (!slab) {
+		if (cache->empty) {
+			slab = cache->empty;
+			kmem_slab_remove(&cache->empty, slab);
+			cache->emptyCount--;
+		} else {
+			slab = kmem_slab_new(cache);
+		}
+
+		kmem_slab_push(&cache->partial, slab);
+	}
+
+	uint16_t i = slab->freeStack[--slab->freeCount];
+
+	if (!slab->freeCount) {
+		kmem_slab_remove(&cache->partial, slab);
+		kmem_slab_push(&cache->full, slab);
+	}
+
+	cache->inUse++;
+
+	return (void*)((uint64_t)slab->objects + i * cache->objectSize);
+}
+
+// Put an object back in its slab. The cache lock must be held.
+static void kmem_cache_free_locked(struct kmem_cache* cache, void* ptr) {
+	struct kmem_slab* slab = (struct kmem_slab*)((uint64_t)ptr & ~((uint64_t)cache->slabPages * PAGE_SIZE - 1));
+
+	if (!slab->freeCount) {
+		kmem_slab_remove(&cache->full, slab);
+		kmem_slab_push(&cache->partial, slab);
+	}
+
+	slab->freeStack[slab->freeCount++] = ((uint64_t)ptr - (uint64_t)slab->objects) / cache->objectSize;
+
+	if (slab->freeCount == cache->objectsPerSlab) {
+		kmem_slab_remove(&cache->partial, slab);
+
+		if (cache->emptyCount < KMEM_CACHE_EMPTY_MAX) {
+			kmem_slab_push(&cache->empty, slab);
+			cache->emptyCount++;
+		} else {
+			kmem_slab_free(slab);
+		}
+	}
+
+	cache->inUse--;
+}
+
+// Queue an object on the remote free queue of another CPU. Returns false if
+// the queue is full.
+static bool kmem_remote_push(struct kmem_cpu_cache* cc, void* obj) {
+	uint64_t tail = __atomic_load_n(&cc->remoteTail, __ATOMIC_RELAXED);
+
+	for (;;) {
+		struct kmem_remote_slot* slot = &cc->remote[tail & (KMEM_REMOTE_QUEUE_SIZE - 1)];
+		int64_t diff = (int64_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (int64_t)tail;
+
+		if (diff < 0)
+			return false;
+
+		if (diff > 0) {
+			tail = __atomic_load_n(&cc->remoteTail, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		if (__atomic_compare_exchange_n(&cc->remoteTail, &tail, tail + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			slot->obj = obj;
+			__atomic_store_n(&slot->seq, tail + 1, __ATOMIC_RELEASE);
+			return true;
+		}
+	}
+}
+
+// Take an object off the remote free queue of the current CPU.
+static void* kmem_remote_pop(struct kmem_cpu_cache* cc) {
+	struct kmem_remote_slot* slot = &cc->remote[cc->remoteHead & (KMEM_REMOTE_QUEUE_SIZE - 1)];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != cc->remoteHead + 1)
+		return NULL;
+
+	void* obj = slot->obj;
+	__atomic_store_n(&slot->seq, cc->remoteHead + KMEM_REMOTE_QUEUE_SIZE, __ATOMIC_RELEASE);
+	cc->remoteHead++;
+
+	return obj;
+}
+
+// Refill an empty magazine, preferring objects other CPUs gave back.
+static void kmem_magazine_refill(struct kmem_cache* cache, struct kmem_cpu_cache* cc) {
+	void* obj;
+
+	while (cc->count < KMEM_MAGAZINE_BATCH && (obj = kmem_remote_pop(cc)))
+		cc->magazine[cc->count++] = obj;
+
+	if (cc->count)
+		return;
+
+	spinlock_acquire(&cache->lock);
+
+	while (cc->count < KMEM_MAGAZINE_BATCH)
+		cc->magazine[cc->count++] = kmem_cache_alloc_locked(cache);
+
+	spinlock_release(&cache->lock);
+}
+
+// Give objects from a magazine back to the slabs.
+static void kmem_magazine_drain(struct kmem_cache* cache, struct kmem_cpu_cache* cc, int count) {
+	spinlock_acquire(&cache->lock);
+
+	while (count-- && cc->count)
+		kmem_cache_free_locked(cache, cc->magazine[--cc->count]);
+
+	spinlock_release(&cache->lock);
+}
+
+void kmem_cache_destroy(struct kmem_cache* cache) {
+	if (!cache)
+		return;
+
+	size_t inUse = cache->inUse;
+	for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+		inUse -= cache->cpu[cpu].count + (cache->cpu[cpu].remoteTail - cache->cpu[cpu].remoteHead);
+
+	if (inUse)
+		debug_log(LOGLEVEL_WARN, "Destroying cache \"%s\" with %lu objects still in use!\n", cache->name, inUse);
+
+	spinlock_acquire(&cacheListLock);
+	for (struct kmem_cache** c = &cacheList; *c; c = &(*c)->next) {
+		if (*c == cache) {
+			*c = cache->next;
+			break;
+		}
+	}
+	spinlock_release(&cacheListLock);
+
+	struct kmem_slab* lists[3] = { cache->partial, cache->full, cache->empty };
+
+	for (int i = 0; i < 3; i++) {
+		struct kmem_slab* slab = lists[i];
+		while (slab) {
+			struct kmem_slab* next = slab->next;
+			kmem_slab_free(slab);
+			slab = next;
+		}
+	}
+
+	kmem_cache_free(&cacheCache, cache);
+}
+
+void* kmem_cache_alloc(struct kmem_cache* cache) {
+	struct kmem_cpu_cache* cc = &cache->cpu[arch_cpu_current()];
+
+	if (!cc->count)
+		kmem_magazine_refill(cache, cc);
+
+	cc->allocs++;
+
+	return cc->magazine[--cc->count];
+}
+
+void kmem_cache_free(struct kmem_cache* cache, void* ptr) {
+	if (ptr == NULL)
+		return;
+
+	struct kmem_slab* slab = (struct kmem_slab*)((uint64_t)ptr & ~((uint64_t)cache->slabPages * PAGE_SIZE - 1));
+	uint64_t offset = (uint64_t)ptr - (uint64_t)slab->objects;
+
+	if (slab->cache != cache || (uint64_t)ptr < (uint64_t)slab->objects || offset % cache->objectSize != 0 ||
+	    offset / cache->objectSize >= cache->objectsPerSlab) {
+		debug_log(LOGLEVEL_WARN, "Invalid kmem_cache_free() address!\n");
+		return;
+	}
+
+	int cpu = arch_cpu_current();
+	struct kmem_cpu_cache* cc = &cache->cpu[cpu];
+
+	cc->frees++;
+
+	// Send objects back to the CPU they came from, unless its queue is full.
+	if (slab->cpu != cpu && kmem_remote_push(&cache->cpu[slab->cpu], ptr)) {
+		cc->remoteFrees++;
+		return;
+	}
+
+	if (cc->count == KMEM_MAGAZINE_SIZE)
+		kmem_magazine_drain(cache, cc, KMEM_MAGAZINE_BATCH);
+
+	cc->magazine[cc->count++] = ptr;
+}
+
+void kmem_cache_stats(struct kmem_cache* cache, struct kmem_cache_stats* stats) {
+	spinlock_acquire(&cache->lock);
+
+	stats->name = cache->name;
+	stats->objectSize = cache->objectSize;
+	stats->slabs = cache->slabs;
+	stats->objects = cache->slabs * cache->objectsPerSlab;
+	stats->inUse = cache->inUse;
+	stats->cached = 0;
+	stats->allocs = 0;
+	stats->frees = 0;
+	stats->remoteFrees = 0;
+
+	spinlock_release(&cache->lock);
+
+	for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		struct kmem_cpu_cache* cc = &cache->cpu[cpu];
+		size_t cached = cc->count + (__atomic_load_n(&cc->remoteTail, __ATOMIC_RELAXED) - cc->remoteHead);
+
+		stats->cached += cached;
+		stats->inUse -= cached;
+		stats->allocs += cc->allocs;
+		stats->frees += cc->frees;
+		stats->remoteFrees += cc->remoteFrees;
+	}
+}
+
+void kmem_cache_dump_stats(void) {
+	struct kmem_cache_stats stats;
+
+	spinlock_acquire(&cacheListLock);
+
+	for (struct kmem_cache* cache = cacheList; cache; cache = cache->next) {
+		kmem_cache_stats(cache, &stats);
+
+		debug_log(LOGLEVEL_INFO, "slab: %s: %zu/%zu objects of %zu bytes in use, %zu cached, %zu slabs\n",
+			  stats.name, stats.inUse, stats.objects, stats.objectSize, stats.cached, stats.slabs);
+	}
+
+	spinlock_release(&cacheListLock);
+}
+
+void* slab_kmalloc(size_t size) {
+	int class = 0;
+
+	if (size > ((size_t)1 << SLAB_KMALLOC_MIN_SHIFT))
+		class = 64 - __builtin_clzll(size - 1) - SLAB_KMALLOC_MIN_SHIFT;
+
+	return kmem_cache_alloc(kmallocCaches[class]);
+}
+
+bool slab_kfree(void* ptr) {
+	uint64_t page = ((uint64_t)ptr - boot_proto_hhdm_offset()) / PAGE_SIZE;
+
+	if (!slabPageMap || page >= slabPageCount)
+		return false;
+
+	if (!(__atomic_load_n(&slabPageMap[page / 64], __ATOMIC_RELAXED) & ((uint64_t)1 << (page % 64))))
+		return false;
+
+	struct kmem_slab* slab = (struct kmem_slab*)((uint64_t)ptr & ~(uint64_t)(PAGE_SIZE - 1));
+	kmem_cache_free(slab->cache, ptr);
+
+	return true;
+}
@@ -9,22 +9,17 @@
  * Virtual Memory Manager
  */
 
+#define LOG_SUBSYSTEM LOG_SUBSYS_MM
+
 #include <symphony/mm.h>
 #include <symphony/arch/arch.h>
 #include <symphony/boot_proto.h>
 #include <symphony/debug.h>
+#include <symphony/bootprof.h>
 
 // Kernel top level page table.
 void* kernelPT;
 
-void vmm_map_range(void* pageTable, uint64_t physAddr, uint64_t virtAddr, size_t size, int flags) {
-	if (size % PAGE_SIZE != 0) 
-		(void)ALIGN_UP(size, PAGE_SIZE);
-
-	for (size_t i = 0; i < size; i += PAGE_SIZE)
-		vmm_map(pageTable, physAddr + i, virtAddr + i, flags);
-}
-
 void* vmm_kernel_pt(void) {
 	assert(kernelPT != NULL, "Attempt to fetch root kernel page table before VMM initialization!\n");
 
@@ -32,11 +27,12 @@ void* vmm_kernel_pt(void) {
 }
 
 int vmm_init(void) {
-	kernelPT = vmm_new_pt();
+	kernelPT = vmm_new_kernel_pt();
 
 	struct boot_proto_memmap_entry entry;
 
 	debug_log(LOGLEVEL_TRACE, "Mapping memmap entries...\n");
+	bootprof_begin("map memmap");
 
 	for (uint64_t i = 0; i < boot_proto_memmap_entry_count(); i++) {
 		entry = boot_proto_memmap_entry_get(i);
@@ -49,14 +45,21 @@ int vmm_init(void) {
 				entry.length = 0;
 		}
 
-		vmm_map_range(kernelPT, entry.base, entry.base + boot_proto_hhdm_offset(), entry.length, (VMM_PRESENT | VMM_RWX));	
+		vmm_map_range(kernelPT, entry.base, entry.base + boot_proto_hhdm_offset(), entry.length, (VMM_PRESENT | VMM_RWX | VMM_GLOBAL));	
 	}
 
+	bootprof_end();
+
 	debug_log(LOGLEVEL_TRACE, "Mapping kernel...\n");
+	bootprof_begin("map kernel");
+
+	vmm_map_range(kernelPT, boot_proto_kernel_physical_base(), boot_proto_kernel_virtual_base(), boot_proto_kernel_size(), (VMM_PRESENT | VMM_RWX | VMM_GLOBAL));
 
-	vmm_map_range(kernelPT, boot_proto_kernel_physical_base(), boot_proto_kernel_virtual_base(), boot_proto_kernel_size(), (VMM_PRESENT | VMM_RWX));
+	bootprof_end();
 
+	bootprof_begin("switch page table");
 	vmm_switch(kernelPT);
+	bootprof_end();
 
 	debug_log(LOGLEVEL_INFO, "VMM Initialized\n");
 
@@ -8,9 +8,16 @@
  * Description:
  * Simple serial driver for the x86 PC rs232 serial interface. The only purpose
  * of this driver is to allow for logging via the serial port.
+ *
+ * Output starts out polled: the driver waits for the transmitter to empty and
+ * then fills the whole 16 byte FIFO at once. Once the COM1 interrupt is routed
+ * to serial_irq(), serial_enable_irq() switches to a transmit queue which is
+ * drained from the THRE interrupt, so writers never wait for the UART unless
+ * the queue is full.
  */
 
 #include <symphony/serial.h>
+#include <symphony/spinlock.h>
 #include <symphony/arch/arch.h>
 
 #define COM_PORT 0x3F8
@@ -19,18 +26,119 @@
 #define COM_INT COM_PORT+1
 #define COM_DIVISOR_LSB COM_PORT
 #define COM_DIVISOR_MSB COM_PORT+1
+#define COM_INT_ID COM_PORT+2
 #define COM_FIFO_CTRL COM_PORT+2
 #define COM_LINE_CONTROL COM_PORT+3
 #define COM_MODEM_CTRL COM_PORT+4
 #define COM_LINE_STATUS COM_PORT+5
 #define COM_SCRATCH COM_PORT+7
 
+// Interrupt enable register
+#define COM_INT_THRE (1 << 1)
+
+// Interrupt identification register
+#define COM_INT_ID_MASK 0x0F
+#define COM_INT_ID_THRE 0x02
+
+// Line status register
+#define COM_LINE_STATUS_THRE (1 << 5)
+
+// Bytes which can be written after THRE is set.
+#define COM_FIFO_SIZE 16
+
+// Base clock of the UART divided by 16.
+#define COM_BAUD_BASE 115200
+
+_Static_assert(SERIAL_BAUD > 0 && SERIAL_BAUD <= COM_BAUD_BASE && COM_BAUD_BASE % SERIAL_BAUD == 0,
+	       "SERIAL_BAUD must divide 115200");
+
+#ifdef __x86_64__
+
+struct serial_queue {
+	char data[SERIAL_TX_QUEUE_SIZE];
+
+	// Only ever grow. head is moved by writers, tail by the transmitter.
+	size_t head;
+	size_t tail;
+};
+
+static struct serial_queue txQueue;
+static struct spinlock txLock = SPINLOCK_INIT;
+
+// Set once the COM1 interrupt drives the transmitter.
+static bool txIrq;
+
+// Set by serial_irq() if it could not take txLock. The lock holder refills
+// the FIFO for it.
+static bool txPending;
+
+// Set for good by serial_sync(). From then on writers bypass the queue and
+// its lock, which might be held by whatever the kernel panicked in.
+static bool txPolled;
+
+static inline bool serial_tx_empty(void) {
+	return arch_inb(COM_LINE_STATUS) & COM_LINE_STATUS_THRE;
+}
+
+// Move up to a FIFO worth of queued bytes to the UART. Returns false if the
+// queue was left empty. txLock must be held.
+static bool serial_tx_fill(void) {
+	if (!serial_tx_empty())
+		return txQueue.head != txQueue.tail;
+
+	for (int i = 0; i < COM_FIFO_SIZE && txQueue.tail != txQueue.head; i++) {
+		arch_outb(COM_DATA, txQueue.data[txQueue.tail % SERIAL_TX_QUEUE_SIZE]);
+		txQueue.tail++;
+	}
+
+	return txQueue.head != txQueue.tail;
+}
+
+// Refill the FIFO and only keep the THRE interrupt enabled while there is
+// something left to send. txLock must be held.
+static void serial_tx_kick(void) {
+	bool pending = serial_tx_fill();
+
+	arch_outb(COM_INT, pending ? COM_INT_THRE : 0x00);
+}
+
+// Write straight to the UART, a FIFO worth of bytes at a time.
+static void serial_write_polled(const char* str, size_t len) {
+	int room = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		for (int j = 0; j < ((str[i] == '\n') ? 2 : 1); j++) {
+			if (room == 0) {
+				while (!serial_tx_empty())
+					continue;
+				room = COM_FIFO_SIZE;
+			}
+
+			arch_outb(COM_DATA, j ? '\r' : str[i]);
+			room--;
+		}
+	}
+}
+
+static void serial_queue_put(char chr) {
+	// Queue full, drain it by polling.
+	while (txQueue.head - txQueue.tail == SERIAL_TX_QUEUE_SIZE)
+		serial_tx_fill();
+
+	txQueue.data[txQueue.head % SERIAL_TX_QUEUE_SIZE] = chr;
+	txQueue.head++;
+}
+
+#endif
+
 int serial_init(void) {
 #ifdef __x86_64__
+	uint16_t divisor = COM_BAUD_BASE / SERIAL_BAUD;
+
 	arch_outb(COM_INT, 0x00);
 	arch_outb(COM_LINE_CONTROL, 0x80);
-	arch_outb(COM_DIVISOR_LSB, 0x0C);
-	arch_outb(COM_DIVISOR_MSB, 0x00);
+	arch_outb(COM_DIVISOR_LSB, divisor & 0xFF);
+	arch_outb(COM_DIVISOR_MSB, divisor >> 8);
 	arch_outb(COM_LINE_CONTROL, 0x03);
 	arch_outb(COM_FIFO_CTRL, 0xC7);
 	arch_outb(COM_MODEM_CTRL, 0x0F);
@@ -39,16 +147,86 @@ int serial_init(void) {
 	return 0;
 }
 
-char serial_char(char chr) {
+void serial_enable_irq(void) {
+#ifdef __x86_64__
+	spinlock_acquire(&txLock);
+	txIrq = true;
+	spinlock_release(&txLock);
+#endif
+}
+
+void serial_irq(void) {
 #ifdef __x86_64__
-	while ((arch_inb(COM_LINE_STATUS) & 0x20) == 0)
+	if ((arch_inb(COM_INT_ID) & COM_INT_ID_MASK) != COM_INT_ID_THRE)
+		return;
+
+	// Whoever holds the lock might be running below us on this CPU.
+	if (!spinlock_try_acquire(&txLock)) {
+		__atomic_store_n(&txPending, true, __ATOMIC_RELEASE);
+		return;
+	}
+
+	serial_tx_kick();
+	spinlock_release(&txLock);
+#endif
+}
+
+void serial_sync(void) {
+#ifdef __x86_64__
+	// The lock might never be released if we are panicking, go on anyway.
+	bool locked = spinlock_try_acquire(&txLock);
+
+	txIrq = false;
+	__atomic_store_n(&txPolled, true, __ATOMIC_RELEASE);
+	arch_outb(COM_INT, 0x00);
+
+	while (serial_tx_fill())
 		continue;
-	
-	arch_outb(COM_DATA, chr);
 
-	if (chr == '\n')
-		serial_char('\r');
+	if (locked)
+		spinlock_release(&txLock);
 #endif
+}
+
+char serial_char(char chr) {
+	serial_write(&chr, 1);
 
 	return chr;
 }
+
+size_t serial_write(const char* str, size_t len) {
+#ifdef __x86_64__
+	if (__atomic_load_n(&txPolled, __ATOMIC_ACQUIRE)) {
+		serial_write_polled(str, len);
+		return len;
+	}
+
+	spinlock_acquire(&txLock);
+
+	for (size_t i = 0; i < len; i++) {
+		serial_queue_put(str[i]);
+
+		if (str[i] == '\n')
+			serial_queue_put('\r');
+	}
+
+	if (txIrq) {
+		serial_tx_kick();
+	} else {
+		while (serial_tx_fill())
+			continue;
+	}
+
+	spinlock_release(&txLock);
+
+	// Refill on behalf of an interrupt which found the lock taken.
+	if (__atomic_exchange_n(&txPending, false, __ATOMIC_ACQUIRE) && spinlock_try_acquire(&txLock)) {
+		serial_tx_kick();
+		spinlock_release(&txLock);
+	}
+#else
+	(void)str;
+#endif
+
+	return len;
+}
@@ -14,21 +14,53 @@
 
 #include <symphony/types.h>
 
+// x86_64 has its own memcpy, memset and memmove (see arch/x86_64/string.c).
+#ifndef __x86_64__
+
+// Word type used to move memory 8 bytes at a time.
+typedef uint64_t __attribute__((may_alias)) string_word;
+
+// Check whether two pointers have the same offset into a word, which means
+// they can both be word aligned at the same time.
+static inline bool string_coaligned(const void* a, const void* b) {
+	return (((uint64_t)a ^ (uint64_t)b) & (sizeof(string_word) - 1)) == 0;
+}
+
 void* memcpy(void* dest, const void* src, size_t n) {
 	uint8_t* pdest = (uint8_t*)dest;
 	const uint8_t* psrc = (const uint8_t*)src;
 
-	for (size_t i = 0; i < n; i++)
-		pdest[i] = psrc[i];
+	if (string_coaligned(pdest, psrc)) {
+		for (; n && ((uint64_t)pdest & (sizeof(string_word) - 1)); n--)
+			*pdest++ = *psrc++;
+
+		for (; n >= sizeof(string_word); n -= sizeof(string_word)) {
+			*(string_word*)pdest = *(const string_word*)psrc;
+			pdest += sizeof(string_word);
+			psrc += sizeof(string_word);
+		}
+	}
+
+	for (; n; n--)
+		*pdest++ = *psrc++;
 
 	return dest;
 }
 
 void* memset(void* s, int c, size_t n) {
 	uint8_t* p = (uint8_t*)s;
+	string_word pattern = (uint8_t)c * 0x0101010101010101;
 
-	for (size_t i = 0; i < n; i++)
-		p[i] = (uint8_t)c;
+	for (; n && ((uint64_t)p & (sizeof(string_word) - 1)); n--)
+		*p++ = (uint8_t)c;
+
+	for (; n >= sizeof(string_word); n -= sizeof(string_word)) {
+		*(string_word*)p = pattern;
+		p += sizeof(string_word);
+	}
+
+	for (; n; n--)
+		*p++ = (uint8_t)c;
 
 	return s;
 }
@@ -37,17 +69,32 @@ void* memmove(void* dest, const void* src, size_t n) {
 	uint8_t* pdest = (uint8_t*)dest;
 	const uint8_t* psrc = (const uint8_t*)src;
 
-	if (src > dest) {
-		for (size_t i = 0; i < n; i++)
-			pdest[i] = psrc[i];
-	} else if (src < dest) {
-		for (size_t i = n; i > 0; i--)
-			pdest[i-1] = psrc[i-1];
+	// A forward copy is fine unless dest starts inside src.
+	if ((uint64_t)pdest - (uint64_t)psrc >= n)
+		return memcpy(dest, src, n);
+
+	pdest += n;
+	psrc += n;
+
+	if (string_coaligned(pdest, psrc)) {
+		for (; n && ((uint64_t)pdest & (sizeof(string_word) - 1)); n--)
+			*--pdest = *--psrc;
+
+		for (; n >= sizeof(string_word); n -= sizeof(string_word)) {
+			pdest -= sizeof(string_word);
+			psrc -= sizeof(string_word);
+			*(string_word*)pdest = *(const string_word*)psrc;
+		}
 	}
 
+	for (; n; n--)
+		*--pdest = *--psrc;
+
 	return dest;
 }
 
+#endif
+
 int memcmp(const void* s1, const void* s2, size_t n) {
 	const uint8_t* p1 = (const uint8_t*)s1;
 	const uint8_t* p2 = (const uint8_t*)s2;